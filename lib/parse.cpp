@@ -543,8 +543,15 @@ void
 Parser::parseGlobalLetStmt()
 {
     current_function = ir_builder->findFunction("_init_");
+    auto &init_blocks = current_function->get()->block_list;
+    auto last_block = init_blocks.empty() ? nullptr : init_blocks.back().get();
     current_block = current_function->newBasicBlock(loop_stack.size());
 
+    // falls through from the previous global definition
+    if (last_block && !last_block->then_block) {
+        last_block->then_block = current_block->get();
+    }
+
     assert(_peak() == T_ID);
 
     auto *symbol = symbol_table->lookup(peaking_string);
@@ -624,10 +631,12 @@ Parser::parseFunctionDefine()
     }
 
     if (_peak() == ';') {
+        symbol_table->popScope();
         _next();
         return;
     }
     else if (_peak() != '{') {
+        symbol_table->popScope();
         throw ParseExpectErrorException(location, "function body", _tokenLiteral());
     }
 
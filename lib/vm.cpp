@@ -1,4 +1,10 @@
+#include <cerrno>
 #include <cstdlib>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "vm.hpp"
 
 using namespace cyan;
@@ -26,8 +32,8 @@ public:
     virtual void
     codegen(CodeGen *_gen)
     {
-        assert(dynamic_cast<VirtualMachine::Generate*>(_gen));
-        dynamic_cast<VirtualMachine::Generate*>(_gen)->gen(this);
+        assert(dynamic_cast<Program::Generate*>(_gen));
+        dynamic_cast<Program::Generate*>(_gen)->gen(this);
     }
 
     virtual void
@@ -75,11 +81,12 @@ public:
 }
 
 void
-vm::VirtualMachine::Generate::generate()
+vm::Program::Generate::generate()
 {
     for (auto &string_pair : ir->string_pool) {
         global_map.emplace(string_pair.second, _product->globals.size());
         _product->globals.push_back(_product->string_pool.size());
+        _product->global_references.push_back(true);
         _product->string_pool.insert(_product->string_pool.end(), string_pair.first.begin(), string_pair.first.end());
         _product->string_pool.push_back('\0');
     }
@@ -91,6 +98,7 @@ vm::VirtualMachine::Generate::generate()
     for (auto &global : ir->global_defines) {
         global_map.emplace(global.first, _product->globals.size());
         _product->globals.push_back(0);
+        _product->global_references.push_back(holdsReference(global.second));
     }
 
     for (auto &func_pair : ir->function_table) {
@@ -98,7 +106,7 @@ vm::VirtualMachine::Generate::generate()
             assert(_product->functions.find(func_pair.first) == _product->functions.end());
             _product->functions.emplace(
                 func_pair.first,
-                std::unique_ptr<Function>(new VMFunction(func_pair.first))
+                std::unique_ptr<Function>(new VMFunction(func_pair.first, _product->vm_function_nr++))
             );
         }
         else {
@@ -112,34 +120,38 @@ vm::VirtualMachine::Generate::generate()
         global_map.emplace(vtable_name, _product->globals.size());
         for (auto &method : *casted) {
             _product->globals.push_back(reinterpret_cast<uintptr_t>(_product->functions.at(method.impl->name).get()));
+            _product->global_references.push_back(true);
         }
     });
 
+    _product->function_slot_base = _product->globals.size();
     for (auto &func_pair : _product->functions) {
         global_map.emplace(
             func_pair.first,
             _product->globals.size()
         );
         _product->globals.push_back(reinterpret_cast<Slot>(dynamic_cast<Function*>(func_pair.second.get())));
+        _product->global_references.push_back(true);
     }
+    _product->function_slot_nr = _product->functions.size();
 
     for (auto &func_pair : ir->function_table) {
         if (func_pair.second.get()) {
-            current_func = dynamic_cast<VMFunction*>(_product->functions.at(func_pair.first).get());
+            current_func = static_cast<VMFunction*>(_product->functions.at(func_pair.first).get());
             generateFunc(func_pair.second.get());
         }
     }
 }
 
 std::ostream &
-vm::VirtualMachine::Generate::generate(std::ostream &os)
+vm::Program::Generate::generate(std::ostream &os)
 {
     generate();
     return os;
 }
 
 void
-vm::VirtualMachine::Generate::generateFunc(::cyan::Function *func)
+vm::Program::Generate::generateFunc(::cyan::Function *func)
 {
     if (!func->block_list.size()) {
         current_func->inst_list.emplace_back(
@@ -152,6 +164,23 @@ vm::VirtualMachine::Generate::generateFunc(::cyan::Function *func)
 
     block_map.clear();
     value_map.clear();
+    target_fixups.clear();
+
+    // registers 1..n receive the arguments
+    size_t argument_nr = func->getPrototype() ? func->getPrototype()->arguments_size() : 0;
+    size_t outgoing_nr = 0;
+    for (auto &bb_ptr : func->block_list) {
+        for (auto &inst_ptr : bb_ptr->inst_list) {
+            if (inst_ptr->is<ArgInst>()) {
+                argument_nr = std::max(argument_nr, static_cast<size_t>(inst_ptr->to<ArgInst>()->getValue() + 1));
+            }
+            else if (inst_ptr->is<CallInst>()) {
+                outgoing_nr = std::max(outgoing_nr, inst_ptr->to<CallInst>()->arguments_size());
+            }
+        }
+    }
+    current_func->register_nr += argument_nr;
+    current_func->argument_nr = argument_nr;
 
     for (auto &bb_ptr : func->block_list) {
         for (
@@ -177,6 +206,24 @@ vm::VirtualMachine::Generate::generateFunc(::cyan::Function *func)
         }
     }
 
+    // holds GLOB addresses inside a single gen, below the outgoing window
+    scratch_reg = current_func->register_nr++;
+
+    // the outgoing window must stay at the end, callees extend beyond it
+    outgoing_base = current_func->register_nr;
+    current_func->register_nr += outgoing_nr + 1;
+
+    findFoldedOperands(func);
+
+    for (auto &spill : spilled_arguments) {
+        current_func->inst_list.emplace_back(
+            I_ARG,
+            0,
+            spill.second,
+            spill.first
+        );
+    }
+
     for (
         auto bb_iter = func->block_list.begin();
         bb_iter != func->block_list.end();
@@ -185,47 +232,36 @@ vm::VirtualMachine::Generate::generateFunc(::cyan::Function *func)
         auto &bb_ptr = *bb_iter;
         block_map.emplace(bb_ptr.get(), current_func->inst_list.size());
         for (auto &inst_ptr : bb_ptr->inst_list) {
-            inst_ptr->codegen(this);
+            if (folded_values.find(inst_ptr.get()) == folded_values.end()) {
+                inst_ptr->codegen(this);
+            }
         }
         if (bb_ptr->condition) {
             if (bb_ptr->then_block == std::next(bb_iter)->get()) {
-                current_func->inst_list.emplace_back(
-                    I_BNR,
-                    0,
-                    value_map.at(bb_ptr->condition),
-                    reinterpret_cast<ImmediateT>(bb_ptr->else_block)
-                );
+                genBranch(bb_ptr->condition, true, bb_ptr->else_block);
             }
             else if (bb_ptr->else_block == std::next(bb_iter)->get()) {
-                current_func->inst_list.emplace_back(
-                    I_BR,
-                    0,
-                    value_map.at(bb_ptr->condition),
-                    reinterpret_cast<ImmediateT>(bb_ptr->then_block)
-                );
+                genBranch(bb_ptr->condition, false, bb_ptr->then_block);
             }
             else {
-                current_func->inst_list.emplace_back(
-                    I_BR,
-                    0,
-                    value_map.at(bb_ptr->condition),
-                    reinterpret_cast<ImmediateT>(bb_ptr->then_block)
-                );
+                genBranch(bb_ptr->condition, false, bb_ptr->then_block);
+                target_fixups.emplace_back(current_func->inst_list.size(), bb_ptr->else_block);
                 current_func->inst_list.emplace_back(
                     I_JUMP,
                     0,
                     0,
-                    reinterpret_cast<ImmediateT>(bb_ptr->else_block)
+                    0
                 );
             }
         }
         else if (bb_ptr->then_block) {
             if (bb_ptr->then_block != std::next(bb_iter)->get()) {
+                target_fixups.emplace_back(current_func->inst_list.size(), bb_ptr->then_block);
                 current_func->inst_list.emplace_back(
                     I_JUMP,
                     0,
                     0,
-                    reinterpret_cast<ImmediateT>(bb_ptr->then_block)
+                    0
                 );
             }
         }
@@ -239,12 +275,21 @@ vm::VirtualMachine::Generate::generateFunc(::cyan::Function *func)
         }
     }
 
-    for (auto &inst : current_func->inst_list) {
+    assert(current_func->register_nr <= std::numeric_limits<RegisterT>::max());
+
+    for (auto &fixup : target_fixups) {
+        auto &inst = current_func->inst_list[fixup.first];
         if (inst.i_op == I_JUMP || inst.i_op == I_BR || inst.i_op == I_BNR) {
-            inst.i_imm = block_map.at(reinterpret_cast<BasicBlock *>(inst.i_imm));
+            inst.i_imm = block_map.at(fixup.second);
+        }
+        else {
+            assert(block_map.at(fixup.second) <= std::numeric_limits<RegisterT>::max());
+            inst.i_target = block_map.at(fixup.second);
         }
     }
 
+    outgoing_base = allocateRegisters(current_func, argument_nr, outgoing_base, outgoing_nr);
+
     /*
     std::cerr << func->getName() << std::endl;
     std::cerr << "  Block Map:" << std::endl;
@@ -260,39 +305,981 @@ vm::VirtualMachine::Generate::generateFunc(::cyan::Function *func)
 }
 
 void
-vm::VirtualMachine::Generate::gen(::cyan::Instruction *)
+vm::Program::Generate::foreachRegister(Instruction &inst, std::function<void(RegisterT &, bool)> callback)
+{
+    switch (inst.i_op) {
+        case I_ARG:
+        case I_GLOB:
+        case I_LC:
+        case I_LI:
+            callback(inst.i_rd, true);
+            break;
+        case I_BR:
+        case I_BNR:
+            callback(inst.i_rd, false);
+            break;
+        case I_BEQ:
+        case I_BLE:
+        case I_BLEU:
+        case I_BLT:
+        case I_BLTU:
+        case I_BNE:
+            callback(inst.i_rs, false);
+            callback(inst.i_rt, false);
+            break;
+        case I_DELETE:
+        case I_RET:
+            callback(inst.i_rs, false);
+            break;
+        case I_STORE8:
+        case I_STORE8U:
+        case I_STORE16:
+        case I_STORE16U:
+        case I_STORE32:
+        case I_STORE32U:
+        case I_STORE64:
+        case I_STORE64U:
+            callback(inst.i_rd, false);
+            callback(inst.i_rs, false);
+            break;
+        case I_ADDI:
+        case I_ALLOC:
+        case I_ANDI:
+        case I_CALL:    // rt is the outgoing window
+        case I_LOAD8:
+        case I_LOAD8U:
+        case I_LOAD16:
+        case I_LOAD16U:
+        case I_LOAD32:
+        case I_LOAD32U:
+        case I_LOAD64:
+        case I_LOAD64U:
+        case I_MOV:
+        case I_NEW:
+        case I_ORI:
+        case I_SEQI:
+        case I_SHLI:
+        case I_SHRI:
+        case I_SHRUI:
+        case I_SLTI:
+        case I_SLTIU:
+        case I_XORI:
+            callback(inst.i_rs, false);
+            callback(inst.i_rd, true);
+            break;
+        case I_JUMP:
+            break;
+        default:
+            callback(inst.i_rs, false);
+            callback(inst.i_rt, false);
+            callback(inst.i_rd, true);
+    }
+}
+
+bool
+vm::Program::Generate::isBranch(const Instruction &inst)
+{
+    return inst.i_op == I_BR || inst.i_op == I_BNR || inst.i_op == I_JUMP ||
+           (inst.i_op >= I_BEQ && inst.i_op <= I_BNE);
+}
+
+size_t
+vm::Program::Generate::branchTarget(const Instruction &inst)
+{ return (inst.i_op >= I_BEQ && inst.i_op <= I_BNE) ? inst.i_target : inst.i_imm; }
+
+void
+vm::Program::Generate::setBranchTarget(Instruction &inst, size_t target)
+{
+    if (inst.i_op >= I_BEQ && inst.i_op <= I_BNE) {
+        inst.i_target = static_cast<RegisterT>(target);
+    }
+    else {
+        inst.i_imm = target;
+    }
+}
+
+void
+vm::Program::Generate::removeInstructions(std::vector<Instruction> &code, const std::vector<bool> &removed)
+{
+    // a branch to a removed instruction lands on the next one kept
+    std::vector<size_t> new_index(code.size() + 1);
+    size_t kept = 0;
+    for (size_t i = 0; i < code.size(); ++i) {
+        new_index[i] = kept;
+        if (!removed[i]) {
+            code[kept++] = code[i];
+        }
+    }
+    new_index[code.size()] = kept;
+    code.erase(code.begin() + kept, code.end());
+
+    for (auto &inst : code) {
+        if (isBranch(inst)) {
+            setBranchTarget(inst, new_index[branchTarget(inst)]);
+        }
+    }
+}
+
+void
+vm::Program::Generate::computeLiveness(
+    const std::vector<Instruction> &code,
+    size_t register_nr,
+    std::vector<size_t> &block_start,
+    std::vector<std::vector<bool> > &live_in,
+    std::vector<std::vector<bool> > &live_out
+)
+{
+    std::vector<bool> leader(code.size() + 1, false);
+    leader[0] = true;
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (isBranch(code[i])) {
+            leader[branchTarget(code[i])] = true;
+            leader[i + 1] = true;
+        }
+        else if (code[i].i_op == I_RET) {
+            leader[i + 1] = true;
+        }
+    }
+
+    block_start.clear();
+    std::vector<size_t> block_of(code.size() + 1);
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (leader[i]) { block_start.push_back(i); }
+        block_of[i] = block_start.size() - 1;
+    }
+    auto block_nr = block_start.size();
+    block_start.push_back(code.size());
+
+    live_in.assign(block_nr, std::vector<bool>(register_nr, false));
+    live_out.assign(block_nr, std::vector<bool>(register_nr, false));
+    std::vector<std::vector<bool> > uses(block_nr, std::vector<bool>(register_nr, false));
+    std::vector<std::vector<bool> > defs(block_nr, std::vector<bool>(register_nr, false));
+    std::vector<std::vector<size_t> > successors(block_nr);
+
+    for (size_t b = 0; b < block_nr; ++b) {
+        for (auto i = block_start[b]; i < block_start[b + 1]; ++i) {
+            auto inst = code[i];
+            foreachRegister(inst, [&](RegisterT &reg, bool define) {
+                if (define) {
+                    defs[b][reg] = true;
+                }
+                else if (!defs[b][reg]) {
+                    uses[b][reg] = true;
+                }
+            });
+        }
+
+        auto &last = code[block_start[b + 1] - 1];
+        if (isBranch(last)) {
+            successors[b].push_back(block_of[branchTarget(last)]);
+        }
+        if (last.i_op != I_JUMP && last.i_op != I_RET && block_start[b + 1] < code.size()) {
+            successors[b].push_back(b + 1);
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t b = block_nr; b-- > 0;) {
+            for (auto succ : successors[b]) {
+                for (size_t reg = 0; reg < register_nr; ++reg) {
+                    if (live_in[succ][reg] && !live_out[b][reg]) {
+                        live_out[b][reg] = true;
+                        changed = true;
+                    }
+                }
+            }
+            for (size_t reg = 0; reg < register_nr; ++reg) {
+                if ((uses[b][reg] || (live_out[b][reg] && !defs[b][reg])) && !live_in[b][reg]) {
+                    live_in[b][reg] = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+vm::RegisterT
+vm::Program::Generate::allocateRegisters(
+    VMFunction *func,
+    size_t argument_nr,
+    RegisterT outgoing_base,
+    size_t outgoing_nr
+)
+{
+    auto &code = func->inst_list;
+    auto register_nr = func->register_nr;
+
+    // the zero register, arguments and the outgoing window keep their place
+    auto is_fixed = [&](RegisterT reg) {
+        return reg <= argument_nr || (reg >= outgoing_base && reg <= outgoing_base + outgoing_nr);
+    };
+
+    std::vector<size_t> block_start;
+    std::vector<std::vector<bool> > live_in;
+    std::vector<std::vector<bool> > live_out;
+    computeLiveness(code, register_nr, block_start, live_in, live_out);
+    auto block_nr = live_in.size();
+
+    // live intervals, a read at 2 * i and a write at 2 * i + 1
+    std::vector<size_t> interval_start(register_nr, std::numeric_limits<size_t>::max());
+    std::vector<size_t> interval_end(register_nr, 0);
+    std::vector<bool> occurs(register_nr, false);
+    auto extend = [&](size_t reg, size_t position) {
+        occurs[reg] = true;
+        interval_start[reg] = std::min(interval_start[reg], position);
+        interval_end[reg] = std::max(interval_end[reg], position);
+    };
+
+    std::vector<RegisterT> hint(register_nr, 0);
+    for (size_t b = 0; b < block_nr; ++b) {
+        for (size_t reg = 0; reg < register_nr; ++reg) {
+            if (is_fixed(reg)) { continue; }
+            if (live_in[b][reg]) { extend(reg, 2 * block_start[b]); }
+            if (live_out[b][reg]) { extend(reg, 2 * block_start[b + 1]); }
+        }
+        for (auto i = block_start[b]; i < block_start[b + 1]; ++i) {
+            foreachRegister(code[i], [&](RegisterT &reg, bool define) {
+                if (!is_fixed(reg)) { extend(reg, 2 * i + (define ? 1 : 0)); }
+            });
+            if (code[i].i_op == I_MOV && !is_fixed(code[i].i_rd) && !is_fixed(code[i].i_rs)) {
+                if (!hint[code[i].i_rd]) { hint[code[i].i_rd] = code[i].i_rs; }
+            }
+        }
+    }
+
+    std::vector<RegisterT> order;
+    for (size_t reg = 0; reg < register_nr; ++reg) {
+        if (occurs[reg]) { order.push_back(static_cast<RegisterT>(reg)); }
+    }
+    std::sort(order.begin(), order.end(), [&](RegisterT a, RegisterT b) {
+        return interval_start[a] < interval_start[b];
+    });
+
+    // linear scan, phi movs reuse their source slot when it dies there
+    std::vector<RegisterT> assigned(register_nr, 0);
+    std::set<std::pair<size_t, RegisterT> > active;
+    std::set<RegisterT> free_slots;
+    RegisterT next_slot = static_cast<RegisterT>(argument_nr + 1);
+    for (auto reg : order) {
+        while (active.size() && active.begin()->first < interval_start[reg]) {
+            free_slots.insert(active.begin()->second);
+            active.erase(active.begin());
+        }
+
+        RegisterT slot;
+        if (hint[reg] && assigned[hint[reg]] && free_slots.count(assigned[hint[reg]])) {
+            slot = assigned[hint[reg]];
+        }
+        else if (free_slots.size()) {
+            slot = *free_slots.begin();
+        }
+        else {
+            slot = next_slot++;
+        }
+        free_slots.erase(slot);
+        assigned[reg] = slot;
+        active.emplace(interval_end[reg], slot);
+    }
+
+    auto new_base = next_slot;
+    for (auto &inst : code) {
+        foreachRegister(inst, [&](RegisterT &reg, bool) {
+            if (reg > argument_nr && is_fixed(reg)) {
+                reg = new_base + (reg - outgoing_base);
+            }
+            else if (!is_fixed(reg)) {
+                reg = assigned[reg];
+            }
+        });
+        if (inst.i_op == I_CALL) {
+            inst.i_rt = new_base;
+        }
+    }
+
+    // drop the movs which got coalesced
+    std::vector<bool> removed(code.size(), false);
+    for (size_t i = 0; i < code.size(); ++i) {
+        removed[i] = code[i].i_op == I_MOV && code[i].i_rd == code[i].i_rs;
+    }
+    removeInstructions(code, removed);
+
+    func->register_nr = new_base + outgoing_nr + 1;
+    return new_base;
+}
+
+bool
+vm::Program::Generate::invertBranch(Instruction &inst)
+{
+    switch (inst.i_op) {
+        case I_BR:      inst.i_op = I_BNR;  break;
+        case I_BNR:     inst.i_op = I_BR;   break;
+        case I_BEQ:     inst.i_op = I_BNE;  break;
+        case I_BNE:     inst.i_op = I_BEQ;  break;
+        // !(a < b) is b <= a and !(a <= b) is b < a
+        case I_BLE:     inst.i_op = I_BLT;  std::swap(inst.i_rs, inst.i_rt); break;
+        case I_BLEU:    inst.i_op = I_BLTU; std::swap(inst.i_rs, inst.i_rt); break;
+        case I_BLT:     inst.i_op = I_BLE;  std::swap(inst.i_rs, inst.i_rt); break;
+        case I_BLTU:    inst.i_op = I_BLEU; std::swap(inst.i_rs, inst.i_rt); break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+void
+vm::Program::Generate::optimize()
+{
+    for (auto &func_pair : _product->functions) {
+        if (func_pair.second->kind == Function::K_VM) {
+            optimizeFunc(static_cast<VMFunction*>(func_pair.second.get()));
+        }
+    }
+}
+
+void
+vm::Program::Generate::optimizeFunc(VMFunction *func)
+{
+    auto &code = func->inst_list;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        // jump threading, a jump onto a RET becomes the RET
+        for (auto &inst : code) {
+            if (!isBranch(inst)) { continue; }
+
+            auto target = branchTarget(inst);
+            std::set<size_t> visited;
+            while (code[target].i_op == I_JUMP && visited.insert(target).second) {
+                target = branchTarget(code[target]);
+            }
+            if (target != branchTarget(inst)) {
+                setBranchTarget(inst, target);
+                changed = true;
+            }
+            if (inst.i_op == I_JUMP && code[target].i_op == I_RET) {
+                inst = code[target];
+                changed = true;
+            }
+        }
+
+        std::vector<bool> label(code.size() + 1, false);
+        for (auto &inst : code) {
+            if (isBranch(inst)) { label[branchTarget(inst)] = true; }
+        }
+
+        std::vector<bool> removed(code.size(), false);
+        std::map<RegisterT, ImmediateT> known;
+        std::map<RegisterT, size_t> unread;
+        bool reachable = true;
+        bool skip_next = false;
+        for (size_t i = 0; i < code.size(); ++i) {
+            auto &inst = code[i];
+
+            if (label[i]) {
+                reachable = true;
+                known.clear();
+                unread.clear();
+            }
+            if (!reachable) {
+                removed[i] = true;
+                continue;
+            }
+
+            if (
+                (isBranch(inst) && branchTarget(inst) == i + 1) ||
+                (inst.i_op == I_MOV && inst.i_rd == inst.i_rs) ||
+                (inst.i_op == I_LI && known.count(inst.i_rd) && known.at(inst.i_rd) == inst.i_imm)
+            ) {
+                removed[i] = true;
+                changed = true;
+                continue;
+            }
+
+            // Bcc L1; JUMP L2; L1: => B!cc L2; L1:
+            if (
+                inst.i_op != I_JUMP && isBranch(inst) &&
+                branchTarget(inst) == i + 2 &&
+                code[i + 1].i_op == I_JUMP && !label[i + 1] &&
+                invertBranch(inst)
+            ) {
+                setBranchTarget(inst, branchTarget(code[i + 1]));
+                removed[i + 1] = true;
+                changed = true;
+                skip_next = true;
+            }
+
+            foreachRegister(inst, [&](RegisterT &reg, bool define) {
+                if (!define) {
+                    unread.erase(reg);
+                    return;
+                }
+
+                // a constant overwritten before being read is dead
+                if (unread.count(reg)) {
+                    removed[unread.at(reg)] = true;
+                    changed = true;
+                }
+                unread.erase(reg);
+                known.erase(reg);
+            });
+
+            if (inst.i_op == I_LI) {
+                known[inst.i_rd] = inst.i_imm;
+                unread[inst.i_rd] = i;
+            }
+            else if (inst.i_op == I_MOV) {
+                if (known.count(inst.i_rs)) { known[inst.i_rd] = known.at(inst.i_rs); }
+            }
+            else if (inst.i_op == I_CALL) {
+                known.clear();
+                unread.clear();
+            }
+            else if (isBranch(inst)) {
+                unread.clear();
+            }
+
+            if (inst.i_op == I_JUMP || inst.i_op == I_RET) {
+                reachable = false;
+            }
+            if (skip_next) {
+                skip_next = false;
+                ++i;
+            }
+        }
+
+        removeInstructions(code, removed);
+
+        // OP t; MOV p, t => OP p, when t dies at the MOV
+        std::vector<size_t> block_start;
+        std::vector<std::vector<bool> > live_in;
+        std::vector<std::vector<bool> > live_out;
+        computeLiveness(code, func->register_nr, block_start, live_in, live_out);
+
+        removed.assign(code.size(), false);
+        for (size_t b = 0; b + 1 < block_start.size(); ++b) {
+            auto live = live_out[b];
+            for (auto i = block_start[b + 1]; i-- > block_start[b];) {
+                auto &inst = code[i];
+                if (inst.i_op == I_MOV && i > block_start[b] && !live[inst.i_rs]) {
+                    auto &prev = code[i - 1];
+                    bool defines = false;
+                    foreachRegister(prev, [&](RegisterT &reg, bool define) {
+                        defines = defines || (define && reg == inst.i_rs);
+                    });
+                    if (defines) {
+                        prev.i_rd = inst.i_rd;
+                        removed[i] = true;
+                        changed = true;
+                        continue;
+                    }
+                }
+
+                foreachRegister(inst, [&](RegisterT &reg, bool define) {
+                    if (define) { live[reg] = false; }
+                });
+                foreachRegister(inst, [&](RegisterT &reg, bool define) {
+                    if (!define) { live[reg] = true; }
+                });
+            }
+        }
+
+        removeInstructions(code, removed);
+    }
+}
+
+void
+vm::Program::Generate::countUses(::cyan::Function *func)
+{
+    use_count.clear();
+
+    auto use = [&](::cyan::Instruction *inst) { ++use_count[inst]; };
+    for (auto &bb_ptr : func->block_list) {
+        if (bb_ptr->condition) {
+            use(bb_ptr->condition);
+        }
+
+        for (auto &inst_ptr : bb_ptr->inst_list) {
+            auto inst = inst_ptr.get();
+            if (inst->is<BinaryInst>()) {
+                use(inst->to<BinaryInst>()->getLeft());
+                use(inst->to<BinaryInst>()->getRight());
+            }
+            else if (inst->is<LoadInst>()) {
+                use(inst->to<LoadInst>()->getAddress());
+            }
+            else if (inst->is<StoreInst>()) {
+                use(inst->to<StoreInst>()->getAddress());
+                use(inst->to<StoreInst>()->getValue());
+            }
+            else if (inst->is<AllocaInst>()) {
+                use(inst->to<AllocaInst>()->getSpace());
+            }
+            else if (inst->is<CallInst>()) {
+                use(inst->to<CallInst>()->getFunction());
+                for (auto &arg : *(inst->to<CallInst>())) {
+                    use(arg);
+                }
+            }
+            else if (inst->is<RetInst>()) {
+                if (inst->to<RetInst>()->getReturnValue()) {
+                    use(inst->to<RetInst>()->getReturnValue());
+                }
+            }
+            else if (inst->is<DeleteInst>()) {
+                use(inst->to<DeleteInst>()->getTarget());
+            }
+            else if (inst->is<NewInst>()) {
+                use(inst->to<NewInst>()->getSpace());
+            }
+            else if (inst->is<MovInst>()) {
+                use(inst->to<MovInst>()->getSource());
+            }
+        }
+    }
+}
+
+void
+vm::Program::Generate::findArguments(::cyan::Function *func)
+{
+    spilled_arguments.clear();
+
+    std::map<::cyan::Instruction *, size_t> loads;
+    for (auto &bb_ptr : func->block_list) {
+        for (auto &inst_ptr : bb_ptr->inst_list) {
+            if (
+                inst_ptr->is<LoadInst>() &&
+                inst_ptr->to<LoadInst>()->getAddress()->is<ArgInst>()
+            ) {
+                ++loads[inst_ptr->to<LoadInst>()->getAddress()];
+            }
+        }
+    }
+
+    // an argument whose address is only loaded from lives in its register
+    std::set<intptr_t> escaped;
+    for (auto &bb_ptr : func->block_list) {
+        for (auto &inst_ptr : bb_ptr->inst_list) {
+            if (inst_ptr->is<ArgInst>() && use_count[inst_ptr.get()] != loads[inst_ptr.get()]) {
+                escaped.emplace(inst_ptr->to<ArgInst>()->getValue());
+            }
+        }
+    }
+
+    for (auto &bb_ptr : func->block_list) {
+        for (auto &inst_ptr : bb_ptr->inst_list) {
+            auto inst = inst_ptr.get();
+            if (inst->is<ArgInst>()) {
+                auto index = inst->to<ArgInst>()->getValue();
+                folded_values.emplace(inst);
+                if (escaped.find(index) == escaped.end()) { continue; }
+
+                if (spilled_arguments.find(index) == spilled_arguments.end()) {
+                    spilled_arguments.emplace(index, value_map.at(inst));
+                }
+                else {
+                    value_map[inst] = spilled_arguments.at(index);
+                }
+            }
+            else if (
+                inst->is<LoadInst>() &&
+                inst->to<LoadInst>()->getAddress()->is<ArgInst>()
+            ) {
+                auto index = inst->to<LoadInst>()->getAddress()->to<ArgInst>()->getValue();
+                if (escaped.find(index) == escaped.end()) {
+                    value_map[inst] = static_cast<RegisterT>(index + 1);
+                    folded_values.emplace(inst);
+                }
+            }
+        }
+    }
+}
+
+void
+vm::Program::Generate::findFusedConditions(::cyan::Function *func)
+{
+    fused_conditions.clear();
+
+    for (auto &bb_ptr : func->block_list) {
+        auto condition = bb_ptr->condition;
+        if (
+            !condition ||
+            !(condition->is<SeqInst>() || condition->is<SltInst>() || condition->is<SleInst>()) ||
+            use_count[condition] != 1
+        ) {
+            continue;
+        }
+
+        auto compare = condition->to<BinaryInst>();
+        auto inst_iter = std::find_if(
+            bb_ptr->inst_list.begin(),
+            bb_ptr->inst_list.end(),
+            [&](const std::unique_ptr<::cyan::Instruction> &inst_ptr) {
+                return inst_ptr.get() == compare;
+            }
+        );
+        if (inst_iter == bb_ptr->inst_list.end()) { continue; }
+
+        // phi movs after the compare may overwrite its operands
+        bool clobbered = false;
+        for (++inst_iter; inst_iter != bb_ptr->inst_list.end(); ++inst_iter) {
+            if (inst_iter->get()->is<MovInst>()) {
+                auto dst_reg = value_map.at(inst_iter->get());
+                if (
+                    dst_reg == value_map.at(compare->getLeft()) ||
+                    dst_reg == value_map.at(compare->getRight())
+                ) {
+                    clobbered = true;
+                    break;
+                }
+            }
+        }
+
+        if (!clobbered) {
+            fused_conditions.emplace(compare);
+            folded_values.emplace(compare);
+        }
+    }
+}
+
+bool
+vm::Program::Generate::getImmediate(::cyan::Instruction *inst, intptr_t &value)
+{
+    if (inst->is<SignedImmInst>()) {
+        value = inst->to<SignedImmInst>()->getValue();
+    }
+    else if (inst->is<UnsignedImmInst>()) {
+        value = static_cast<intptr_t>(inst->to<UnsignedImmInst>()->getValue());
+    }
+    else {
+        return false;
+    }
+    return fitsImmediate(value);
+}
+
+void
+vm::Program::Generate::normalizeAdd(AddInst *inst)
+{
+    if (
+        inst->getRight()->getType()->is<PointerType>() ||
+        inst->getRight()->getType()->is<VTableType>() ||
+        inst->getRight()->getType()->is<StructType>() ||
+        inst->getRight()->getType()->is<ConceptType>() ||
+        inst->getRight()->getType()->is<FunctionType>()
+    ) {
+        auto t = inst->getLeft();
+        inst->setLeft(inst->getRight());
+        inst->setRight(t);
+    }
+}
+
+vm::ShiftT
+vm::Program::Generate::scaleShift(Type *type)
+{
+    if (type->is<PointerType>()) {
+        auto base_type = type->to<PointerType>()->getBaseType();
+        if (base_type->is<NumericType>()) {
+            return __builtin_ctz(base_type->to<NumericType>()->getBitwiseWidth()) - 3;
+        }
+        else {
+            return __builtin_ctz(CYAN_PRODUCT_BYTES);
+        }
+    }
+    else if (
+        type->is<VTableType>() ||
+        type->is<StructType>() ||
+        type->is<ConceptType>() ||
+        type->is<FunctionType>()
+    ) {
+        return __builtin_ctz(CYAN_PRODUCT_BYTES);
+    }
+    return 0;
+}
+
+bool
+vm::Program::Generate::holdsReference(Type *type)
+{ return !type->is<NumericType>(); }
+
+/**
+ * Index in Program::layouts of the slots a NEW of type may hold addresses in, for saveImage
+ */
+vm::RegisterT
+vm::Program::Generate::layoutOf(Type *type)
+{
+    auto layout_iter = layout_map.find(type);
+    if (layout_iter != layout_map.end()) {
+        return layout_iter->second;
+    }
+
+    std::vector<bool> layout;
+    if (type->is<ArrayType>()) {
+        layout.push_back(holdsReference(type->to<ArrayType>()->getBaseType()));
+    }
+    else if (type->is<StructType>()) {
+        auto struct_type = type->to<StructType>();
+        for (auto &member : *struct_type) {
+            layout.push_back(holdsReference(member.type));
+        }
+        layout.insert(layout.end(), struct_type->concept_size(), true);     // vtables
+    }
+    else {
+        layout.push_back(true);
+    }
+    if (layout.empty()) {
+        layout.push_back(false);
+    }
+
+    assert(_product->layouts.size() <= std::numeric_limits<RegisterT>::max());
+    auto index = static_cast<RegisterT>(_product->layouts.size());
+    _product->layouts.push_back(layout);
+    layout_map.emplace(type, index);
+    return index;
+}
+
+::cyan::Instruction *
+vm::Program::Generate::foldImmediate(BinaryInst *inst)
+{
+    intptr_t value;
+
+    if (inst->is<AddInst>()) {
+        normalizeAdd(inst->to<AddInst>());
+    }
+
+    bool commutative = (
+        inst->is<AddInst>() ||
+        inst->is<AndInst>() ||
+        inst->is<OrInst>() ||
+        inst->is<XorInst>() ||
+        inst->is<SeqInst>()
+    );
+    bool right_immediate = getImmediate(inst->getRight(), value);
+    if (!right_immediate && !(commutative && getImmediate(inst->getLeft(), value))) {
+        return nullptr;
+    }
+
+    auto operand = right_immediate ? inst->getLeft() : inst->getRight();
+    auto immediate = right_immediate ? inst->getRight() : inst->getLeft();
+
+    if (inst->is<AddInst>() || inst->is<SubInst>()) {
+        value *= static_cast<intptr_t>(1) << scaleShift(operand->getType());
+        if (inst->is<SubInst>()) {
+            value = -value;
+        }
+    }
+    else if (inst->is<SleInst>()) {
+        bool use_unsigned = (inst->getLeft()->getType()->is<UnsignedIntegerType>() ||
+                             inst->getRight()->getType()->is<UnsignedIntegerType>());
+        if (use_unsigned && value == -1) {
+            return nullptr;
+        }
+        value += 1;
+    }
+    else if (
+        !commutative &&
+        !inst->is<ShlInst>() &&
+        !inst->is<ShrInst>() &&
+        !inst->is<SltInst>()
+    ) {
+        return nullptr;
+    }
+
+    if (!fitsImmediate(value)) {
+        return nullptr;
+    }
+
+    folded_operands.emplace(inst, std::make_pair(operand, value));
+    --use_count[immediate];
+    return immediate;
+}
+
+void
+vm::Program::Generate::findFoldedOperands(::cyan::Function *func)
+{
+    folded_values.clear();
+    folded_operands.clear();
+
+    countUses(func);
+    findArguments(func);
+    findFusedConditions(func);
+
+    std::set<AddInst *> folded_addresses;
+    for (auto &bb_ptr : func->block_list) {
+        std::set<::cyan::Instruction *> defined;
+        for (auto &inst_ptr : bb_ptr->inst_list) {
+            auto inst = inst_ptr.get();
+            if (inst->is<LoadInst>() || inst->is<StoreInst>()) {
+                auto address = inst->is<LoadInst>()
+                    ? inst->to<LoadInst>()->getAddress()
+                    : inst->to<StoreInst>()->getAddress();
+
+                intptr_t value;
+                if (
+                    address->is<AddInst>() &&
+                    defined.find(address) != defined.end()
+                ) {
+                    auto add_inst = address->to<AddInst>();
+                    normalizeAdd(add_inst);
+                    if (getImmediate(add_inst->getRight(), value)) {
+                        value *= static_cast<intptr_t>(1) << scaleShift(add_inst->getLeft()->getType());
+                        if (fitsImmediate(value)) {
+                            folded_operands.emplace(inst, std::make_pair(add_inst->getLeft(), value));
+                            folded_addresses.emplace(add_inst);
+                            --use_count[add_inst];
+                        }
+                    }
+                }
+            }
+            defined.emplace(inst);
+        }
+    }
+
+    std::set<::cyan::Instruction *> folded_immediates;
+    for (auto &add_inst : folded_addresses) {
+        if (!use_count[add_inst]) {
+            folded_values.emplace(add_inst);
+            --use_count[add_inst->getLeft()];
+            --use_count[add_inst->getRight()];
+            folded_immediates.emplace(add_inst->getRight());
+        }
+    }
+
+    for (auto &bb_ptr : func->block_list) {
+        for (auto &inst_ptr : bb_ptr->inst_list) {
+            auto inst = inst_ptr.get();
+            if (
+                !inst->is<BinaryInst>() ||
+                folded_values.find(inst) != folded_values.end()
+            ) {
+                continue;
+            }
+
+            auto immediate = foldImmediate(inst->to<BinaryInst>());
+            if (immediate) {
+                folded_immediates.emplace(immediate);
+            }
+        }
+    }
+
+    for (auto &immediate : folded_immediates) {
+        if (!use_count[immediate]) {
+            folded_values.emplace(immediate);
+        }
+    }
+}
+
+bool
+vm::Program::Generate::genImmediateForm(::cyan::Instruction *inst, OperatorT op)
+{
+    auto fold = folded_operands.find(inst);
+    if (fold == folded_operands.end()) {
+        return false;
+    }
+
+    current_func->inst_list.emplace_back(
+        op,
+        0,
+        value_map.at(inst),
+        value_map.at(fold->second.first),
+        static_cast<RegisterT>(fold->second.second)
+    );
+    return true;
+}
+
+void
+vm::Program::Generate::genBranch(::cyan::Instruction *condition, bool negative, BasicBlock *target)
+{
+    target_fixups.emplace_back(current_func->inst_list.size(), target);
+
+    if (fused_conditions.find(condition) == fused_conditions.end()) {
+        current_func->inst_list.emplace_back(
+            negative ? I_BNR : I_BR,
+            0,
+            value_map.at(condition),
+            0
+        );
+        return;
+    }
+
+    auto compare = condition->to<BinaryInst>();
+    auto left = value_map.at(compare->getLeft());
+    auto right = value_map.at(compare->getRight());
+    bool use_unsigned = (compare->getLeft()->getType()->is<UnsignedIntegerType>() ||
+                         compare->getRight()->getType()->is<UnsignedIntegerType>());
+
+    OperatorT op;
+    if (compare->is<SeqInst>()) {
+        op = negative ? I_BNE : I_BEQ;
+    }
+    else if (compare->is<SltInst>()) {
+        op = negative ? (use_unsigned ? I_BLEU : I_BLE)
+                      : (use_unsigned ? I_BLTU : I_BLT);
+    }
+    else {
+        op = negative ? (use_unsigned ? I_BLTU : I_BLT)
+                      : (use_unsigned ? I_BLEU : I_BLE);
+    }
+
+    if (negative && !compare->is<SeqInst>()) {
+        std::swap(left, right);
+    }
+
+    current_func->inst_list.emplace_back(
+        op,
+        0,
+        0,
+        left,
+        right
+    );
+}
+
+void
+vm::Program::Generate::genLoadImmediate(RegisterT rd, intptr_t value)
+{
+    if (
+        value >= std::numeric_limits<SignedImmediateT>::min() &&
+        value <= std::numeric_limits<SignedImmediateT>::max()
+    ) {
+        current_func->inst_list.emplace_back(
+            I_LI,
+            0,
+            rd,
+            static_cast<ImmediateT>(value)
+        );
+        return;
+    }
+
+    current_func->inst_list.emplace_back(
+        I_LC,
+        0,
+        rd,
+        current_func->constant_pool.size()
+    );
+    current_func->constant_pool.push_back(static_cast<Slot>(value));
+}
+
+void
+vm::Program::Generate::gen(::cyan::Instruction *)
 { assert(false); }
 
 void
-vm::VirtualMachine::Generate::gen(SignedImmInst *inst)
-{
-    current_func->inst_list.emplace_back(
-        I_LI,
-        0,
-        value_map.at(inst),
-        inst->getValue()
-    );
-}
+vm::Program::Generate::gen(SignedImmInst *inst)
+{ genLoadImmediate(value_map.at(inst), inst->getValue()); }
 
 void
-vm::VirtualMachine::Generate::gen(UnsignedImmInst *inst) 
-{
-    current_func->inst_list.emplace_back(
-        I_LI,
-        0,
-        value_map.at(inst),
-        inst->getValue()
-    );
-}
+vm::Program::Generate::gen(UnsignedImmInst *inst) 
+{ genLoadImmediate(value_map.at(inst), static_cast<intptr_t>(inst->getValue())); }
 
 void
-vm::VirtualMachine::Generate::gen(GlobalInst *inst)
+vm::Program::Generate::gen(GlobalInst *inst)
 {
     if (
         inst->getType()->is<FunctionType>() ||
         inst->getType()->is<ArrayType>()
     ) {
-        auto temp_reg = current_func->register_nr++;
+        auto temp_reg = scratch_reg;
         current_func->inst_list.emplace_back(
             I_GLOB,
             0,
@@ -322,56 +1309,18 @@ vm::VirtualMachine::Generate::gen(GlobalInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(ArgInst *inst)
-{
-    current_func->inst_list.emplace_back(
-        I_ARG,
-        0,
-        value_map.at(inst),
-        inst->getValue()
-    );
-}
+vm::Program::Generate::gen(ArgInst *inst)
+{ assert(false); }
 
 void
-vm::VirtualMachine::Generate::gen(AddInst *inst)
+vm::Program::Generate::gen(AddInst *inst)
 {
-    if (
-        inst->getRight()->getType()->is<PointerType>() ||
-        inst->getRight()->getType()->is<VTableType>() ||
-        inst->getRight()->getType()->is<StructType>() ||
-        inst->getRight()->getType()->is<ConceptType>() ||
-        inst->getRight()->getType()->is<FunctionType>()
-    ) {
-        auto t = inst->getLeft();
-        inst->setLeft(inst->getRight());
-        inst->setRight(t);
-    }
-
-    ShiftT shift;
-    if (inst->getLeft()->getType()->is<PointerType>()) {
-        auto base_type = inst->getLeft()->getType()->to<PointerType>()->getBaseType();
-        if (base_type->is<NumericType>()) {
-            shift = __builtin_ctz(base_type->to<NumericType>()->getBitwiseWidth()) - 3;
-        }
-        else {
-            shift = __builtin_ctz(CYAN_PRODUCT_BYTES);
-        }
-    }
-    else if (
-        inst->getLeft()->getType()->is<VTableType>() ||
-        inst->getLeft()->getType()->is<StructType>() ||
-        inst->getLeft()->getType()->is<ConceptType>() ||
-        inst->getLeft()->getType()->is<FunctionType>()
-    ) {
-        shift = __builtin_ctz(CYAN_PRODUCT_BYTES);
-    }
-    else {
-        shift = 0;
-    }
+    normalizeAdd(inst);
+    if (genImmediateForm(inst, I_ADDI)) { return; }
 
     current_func->inst_list.emplace_back(
         I_ADD,
-        shift,
+        scaleShift(inst->getLeft()->getType()),
         value_map.at(inst),
         value_map.at(inst->getLeft()),
         value_map.at(inst->getRight())
@@ -379,33 +1328,13 @@ vm::VirtualMachine::Generate::gen(AddInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(SubInst *inst)
+vm::Program::Generate::gen(SubInst *inst)
 {
-    ShiftT shift;
-    if (inst->getLeft()->getType()->is<PointerType>()) {
-        auto base_type = inst->getLeft()->getType()->to<PointerType>()->getBaseType();
-        if (base_type->is<NumericType>()) {
-            shift = __builtin_ctz(base_type->to<NumericType>()->getBitwiseWidth()) - 3;
-        }
-        else {
-            shift = __builtin_ctz(CYAN_PRODUCT_BYTES);
-        }
-    }
-    else if (
-        inst->getLeft()->getType()->is<VTableType>() ||
-        inst->getLeft()->getType()->is<StructType>() ||
-        inst->getLeft()->getType()->is<ConceptType>() ||
-        inst->getLeft()->getType()->is<FunctionType>()
-    ) {
-        shift = __builtin_ctz(CYAN_PRODUCT_BYTES);
-    }
-    else {
-        shift = 0;
-    }
+    if (genImmediateForm(inst, I_ADDI)) { return; }
 
     current_func->inst_list.emplace_back(
         I_SUB,
-        shift,
+        scaleShift(inst->getLeft()->getType()),
         value_map.at(inst),
         value_map.at(inst->getLeft()),
         value_map.at(inst->getRight())
@@ -413,7 +1342,7 @@ vm::VirtualMachine::Generate::gen(SubInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(MulInst *inst)
+vm::Program::Generate::gen(MulInst *inst)
 {
     bool use_unsigned = (inst->getLeft()->getType()->is<UnsignedIntegerType>() ||
                          inst->getRight()->getType()->is<UnsignedIntegerType>());
@@ -428,7 +1357,7 @@ vm::VirtualMachine::Generate::gen(MulInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(DivInst *inst)
+vm::Program::Generate::gen(DivInst *inst)
 {
     bool use_unsigned = (inst->getLeft()->getType()->is<UnsignedIntegerType>() ||
                          inst->getRight()->getType()->is<UnsignedIntegerType>());
@@ -443,7 +1372,7 @@ vm::VirtualMachine::Generate::gen(DivInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(ModInst *inst)
+vm::Program::Generate::gen(ModInst *inst)
 {
     bool use_unsigned = (inst->getLeft()->getType()->is<UnsignedIntegerType>() ||
                          inst->getRight()->getType()->is<UnsignedIntegerType>());
@@ -458,8 +1387,10 @@ vm::VirtualMachine::Generate::gen(ModInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(ShlInst *inst)
+vm::Program::Generate::gen(ShlInst *inst)
 {
+    if (genImmediateForm(inst, I_SHLI)) { return; }
+
     bool use_unsigned = inst->getLeft()->getType()->is<UnsignedIntegerType>();
 
     current_func->inst_list.emplace_back(
@@ -472,9 +1403,10 @@ vm::VirtualMachine::Generate::gen(ShlInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(ShrInst *inst)
+vm::Program::Generate::gen(ShrInst *inst)
 {
     bool use_unsigned = inst->getLeft()->getType()->is<UnsignedIntegerType>();
+    if (genImmediateForm(inst, use_unsigned ? I_SHRUI : I_SHRI)) { return; }
 
     current_func->inst_list.emplace_back(
         use_unsigned ? I_SHRU : I_SHR,
@@ -486,8 +1418,10 @@ vm::VirtualMachine::Generate::gen(ShrInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(OrInst *inst)
+vm::Program::Generate::gen(OrInst *inst)
 {
+    if (genImmediateForm(inst, I_ORI)) { return; }
+
     current_func->inst_list.emplace_back(
         I_OR,
         0,
@@ -498,8 +1432,10 @@ vm::VirtualMachine::Generate::gen(OrInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(AndInst *inst)
+vm::Program::Generate::gen(AndInst *inst)
 {
+    if (genImmediateForm(inst, I_ANDI)) { return; }
+
     current_func->inst_list.emplace_back(
         I_AND,
         0,
@@ -510,7 +1446,7 @@ vm::VirtualMachine::Generate::gen(AndInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(NorInst *inst)
+vm::Program::Generate::gen(NorInst *inst)
 {
     current_func->inst_list.emplace_back(
         I_NOR,
@@ -522,8 +1458,10 @@ vm::VirtualMachine::Generate::gen(NorInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(XorInst *inst)
+vm::Program::Generate::gen(XorInst *inst)
 {
+    if (genImmediateForm(inst, I_XORI)) { return; }
+
     current_func->inst_list.emplace_back(
         I_XOR,
         0,
@@ -534,8 +1472,10 @@ vm::VirtualMachine::Generate::gen(XorInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(SeqInst *inst)
+vm::Program::Generate::gen(SeqInst *inst)
 {
+    if (genImmediateForm(inst, I_SEQI)) { return; }
+
     current_func->inst_list.emplace_back(
         I_SEQ,
         0,
@@ -546,10 +1486,11 @@ vm::VirtualMachine::Generate::gen(SeqInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(SltInst *inst)
+vm::Program::Generate::gen(SltInst *inst)
 {
     bool use_unsigned = (inst->getLeft()->getType()->is<UnsignedIntegerType>() ||
                          inst->getRight()->getType()->is<UnsignedIntegerType>());
+    if (genImmediateForm(inst, use_unsigned ? I_SLTIU : I_SLTI)) { return; }
 
     current_func->inst_list.emplace_back(
         use_unsigned ? I_SLTU : I_SLT,
@@ -561,10 +1502,11 @@ vm::VirtualMachine::Generate::gen(SltInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(SleInst *inst)
+vm::Program::Generate::gen(SleInst *inst)
 {
     bool use_unsigned = (inst->getLeft()->getType()->is<UnsignedIntegerType>() ||
                          inst->getRight()->getType()->is<UnsignedIntegerType>());
+    if (genImmediateForm(inst, use_unsigned ? I_SLTIU : I_SLTI)) { return; }
 
     current_func->inst_list.emplace_back(
         use_unsigned ? I_SLEU : I_SLE,
@@ -576,7 +1518,7 @@ vm::VirtualMachine::Generate::gen(SleInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(LoadInst *inst)
+vm::Program::Generate::gen(LoadInst *inst)
 {
     OperatorT op;
     if (inst->getAddress()->getType()->is<PointerType>()) {
@@ -603,17 +1545,24 @@ vm::VirtualMachine::Generate::gen(LoadInst *inst)
 #endif
     }
 
+    auto base = inst->getAddress();
+    intptr_t displacement = 0;
+    if (folded_operands.find(inst) != folded_operands.end()) {
+        base = folded_operands.at(inst).first;
+        displacement = folded_operands.at(inst).second;
+    }
+
     current_func->inst_list.emplace_back(
         op,
         0,
         value_map.at(inst),
-        value_map.at(inst->getAddress()),
-        0
+        value_map.at(base),
+        static_cast<RegisterT>(displacement)
     );
 }
 
 void
-vm::VirtualMachine::Generate::gen(StoreInst *inst)
+vm::Program::Generate::gen(StoreInst *inst)
 {
     OperatorT op;
     auto base_type = inst->getAddress()->getType()->to<PointerType>()->getBaseType();
@@ -631,17 +1580,24 @@ vm::VirtualMachine::Generate::gen(StoreInst *inst)
 #endif
     }
 
+    auto base = inst->getAddress();
+    intptr_t displacement = 0;
+    if (folded_operands.find(inst) != folded_operands.end()) {
+        base = folded_operands.at(inst).first;
+        displacement = folded_operands.at(inst).second;
+    }
+
     current_func->inst_list.emplace_back(
         op,
         0,
-        value_map.at(inst),
-        value_map.at(inst->getAddress()),
-        value_map.at(inst->getValue())
+        value_map.at(inst->getValue()),
+        value_map.at(base),
+        static_cast<RegisterT>(displacement)
     );
 }
 
 void
-vm::VirtualMachine::Generate::gen(AllocaInst *inst)
+vm::Program::Generate::gen(AllocaInst *inst)
 {
     current_func->inst_list.emplace_back(
         I_ALLOC,
@@ -653,84 +1609,55 @@ vm::VirtualMachine::Generate::gen(AllocaInst *inst)
 }
 
 void
-vm::VirtualMachine::Generate::gen(CallInst *inst)
+vm::Program::Generate::gen(CallInst *inst)
 {
-    if (inst->arguments_size()) {
-        for (intptr_t i = inst->arguments_size() - 1; i >= 0; --i) {
-            current_func->inst_list.emplace_back(
-                I_PUSH,
-                0,
-                value_map.at(inst->getArgumentByIndex(i)),
-                0
-            );
-        }
+    assert(inst->arguments_size() <= std::numeric_limits<ShiftT>::max());
+
+    for (size_t i = 0; i < inst->arguments_size(); ++i) {
+        current_func->inst_list.emplace_back(
+            I_MOV,
+            0,
+            static_cast<RegisterT>(outgoing_base + 1 + i),
+            value_map.at(inst->getArgumentByIndex(i)),
+            0
+        );
     }
 
     current_func->inst_list.emplace_back(
         I_CALL,
-        0,
+        static_cast<ShiftT>(inst->arguments_size()),
         value_map.at(inst),
         value_map.at(inst->getFunction()),
-        0
+        outgoing_base
     );
-
-    if (inst->arguments_size()) {
-        current_func->inst_list.emplace_back(
-            I_POP,
-            0,
-            0,
-            inst->arguments_size()
-        );
-    }
 }
 
 void
-vm::VirtualMachine::Generate::gen(RetInst *inst)
+vm::Program::Generate::gen(RetInst *inst)
 {
     current_func->inst_list.emplace_back(
         I_RET,
         0,
-        value_map.at(inst),
+        0,
         inst->getReturnValue() ? value_map.at(inst->getReturnValue()) : 0,
         0
     );
 }
 
 void
-vm::VirtualMachine::Generate::gen(NewInst *inst)
+vm::Program::Generate::gen(NewInst *inst)
 {
     current_func->inst_list.emplace_back(
         I_NEW,
         0,
         value_map.at(inst),
         value_map.at(inst->getSpace()),
-        0
+        layoutOf(inst->getType())
     );
 
     if (inst->getType()->is<StructType>()) {
         auto struct_type = inst->getType()->to<StructType>();
-        auto global_inst = current_func->register_nr++;
-        auto addr_inst = current_func->register_nr++;
-        auto one_inst = current_func->register_nr++;
-        current_func->inst_list.emplace_back(
-            I_LI,
-            0,
-            addr_inst,
-            struct_type->members_size()
-        );
-        current_func->inst_list.emplace_back(
-            I_LI,
-            0,
-            one_inst,
-            1
-        );
-        current_func->inst_list.emplace_back(
-            I_ADD,
-            __builtin_ctz(CYAN_PRODUCT_BYTES),
-            addr_inst,
-            value_map.at(inst),
-            addr_inst
-        );
+        auto global_inst = scratch_reg;
         for (size_t i = 0; i < struct_type->concept_size(); ++i) {
             current_func->inst_list.emplace_back(
                 I_GLOB,
@@ -745,6 +1672,8 @@ vm::VirtualMachine::Generate::gen(NewInst *inst)
                     )->to_string() + "__vtable"
                 )
             );
+            auto displacement = (struct_type->members_size() + i) * CYAN_PRODUCT_BYTES;
+            assert(fitsImmediate(static_cast<intptr_t>(displacement)));
             current_func->inst_list.emplace_back(
 #if __CYAN_64__
                 I_STORE64U,
@@ -752,39 +1681,32 @@ vm::VirtualMachine::Generate::gen(NewInst *inst)
                 I_STORE32U,
 #endif
                 0,
-                0,
-                addr_inst,
-                global_inst
-            );
-            current_func->inst_list.emplace_back(
-                I_ADD,
-                __builtin_ctz(CYAN_PRODUCT_BYTES),
-                addr_inst,
-                addr_inst,
-                one_inst
+                global_inst,
+                value_map.at(inst),
+                static_cast<RegisterT>(displacement)
             );
         }
     }
 }
 
 void
-vm::VirtualMachine::Generate::gen(DeleteInst *inst)
+vm::Program::Generate::gen(DeleteInst *inst)
 {
     current_func->inst_list.emplace_back(
         I_DELETE,
         0,
-        value_map.at(inst),
+        0,
         value_map.at(inst->getTarget()),
         0
     );
 }
 
 void
-vm::VirtualMachine::Generate::gen(PhiInst *inst)
+vm::Program::Generate::gen(PhiInst *inst)
 { assert(false); }
 
 void
-vm::VirtualMachine::Generate::gen(vm::MovInst *inst)
+vm::Program::Generate::gen(vm::MovInst *inst)
 {
     current_func->inst_list.emplace_back(
         I_MOV,
@@ -795,29 +1717,240 @@ vm::VirtualMachine::Generate::gen(vm::MovInst *inst)
     );
 }
 
-vm::Slot
-vm::VirtualMachine::run()
+vm::RegisterStack::RegisterStack(Slot *&limit)
+    : limit(limit)
 {
-    Frame *current_frame = frame_stack.top().get();
-    const Instruction *pc = current_frame->pc;
-    auto inst = pc;
+    size_t size = CHUNK_SLOTS;
+    chunks.emplace_back(std::unique_ptr<Slot[]>(new Slot[size]), size);
+    chunk_base = chunks.back().first.get();
+    limit = chunk_base + size;
+}
 
-#if CYAN_USE_COMPUTED_GOTO
+vm::Slot *
+vm::RegisterStack::enterSlow(Slot *window, size_t slots, size_t arguments)
+{
+    if (chunk_index + 1 == MAX_CHUNKS) {
+        return nullptr;
+    }
 
-#define VM_CASE(label)          label:
-#define VM_DISPATCH()                       \
-    do {                                    \
-        inst = pc++;                        \
-        goto *DISPATCH_TABLE[inst->i_op];   \
-    } while(false)
+    size_t size = CHUNK_SLOTS;
+    size = std::max(slots, size);
 
-#else
+    ++chunk_index;
+    if (chunk_index == chunks.size()) {
+        chunks.emplace_back(std::unique_ptr<Slot[]>(new Slot[size]), size);
+    }
+    else if (chunks[chunk_index].second < slots) {
+        chunks[chunk_index].first.reset(new Slot[size]);
+        chunks[chunk_index].second = size;
+    }
 
-#define VM_CASE(label)          case I_##label:
-#define VM_DISPATCH()           break
+    chunk_base = chunks[chunk_index].first.get();
+    limit = chunk_base + chunks[chunk_index].second;
+    std::copy(window + 1, window + 1 + arguments, chunk_base + 1);
+    return chunk_base;
+}
 
-#endif
+void
+vm::RegisterStack::leaveSlow()
+{
+    if (!chunk_index) { return; }
+
+    --chunk_index;
+    chunk_base = chunks[chunk_index].first.get();
+    limit = chunk_base + chunks[chunk_index].second;
+}
+
+vm::GuardedStack::GuardedStack(size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    guard_size = page_size;
+    usable_size = (size + page_size - 1) / page_size * page_size;
+
+    auto mapping = mmap(
+        nullptr,
+        guard_size + usable_size,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0
+    );
+    if (mapping == MAP_FAILED) {
+        throw MapFailedException("VM stack", errno);
+    }
+
+    reservation = static_cast<char *>(mapping);
+    if (mprotect(reservation, guard_size, PROT_NONE)) {
+        auto error = errno;
+        munmap(reservation, guard_size + usable_size);
+        throw MapFailedException("VM stack guard page", error);
+    }
+}
+
+vm::GuardedStack::~GuardedStack()
+{ munmap(reservation, guard_size + usable_size); }
+
+vm::ObjectAllocator::ObjectAllocator()
+{ std::fill(std::begin(free_lists), std::end(free_lists), nullptr); }
+
+vm::ObjectAllocator::~ObjectAllocator()
+{
+    while (chunk_list) {
+        auto chunk = chunk_list;
+        chunk_list = *reinterpret_cast<char **>(chunk);
+        std::free(chunk);
+    }
+}
+
+void *
+vm::ObjectAllocator::allocateSlow(size_t size)
+{
+    if (size > MAX_SMALL_SIZE) {
+        auto block = static_cast<Slot *>(std::malloc(size + sizeof(Slot)));
+        *block = LARGE_CLASS;
+        ++stats.allocations;
+        stats.bytes += size;
+        ++stats.live_objects;
+        return block + 1;
+    }
+
+    // the rest of the current chunk is left unused
+    auto chunk = static_cast<char *>(std::malloc(CHUNK_SIZE));
+    *reinterpret_cast<char **>(chunk) = chunk_list;
+    chunk_list = chunk;
+    ++stats.chunks;
+    bump = chunk + sizeof(char *);
+    bump_limit = chunk + CHUNK_SIZE;
+    return allocate(size);
+}
+
+vm::Context::Context(const Program *program, size_t stack_size)
+    : program(program),
+      globals(program->globals),
+      register_stack(jit_state.register_limit),
+      stack(stack_size),
+      stack_pointer(stack.size()),
+      initialized(program->initialized)
+{
+    jit_state.context = this;
+    frames.reserve(INITIAL_FRAMES);
+
+    if (program->heap_size) {
+        // private mapping of the snapshot heap, pages are copied only when written
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        auto map_offset = program->heap_offset / page_size * page_size;
+        heap_mapping_size = program->heap_offset - map_offset + program->heap_size;
+
+        auto mapping = mmap(
+            nullptr,
+            heap_mapping_size,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE,
+            program->image_fd,
+            map_offset
+        );
+        if (mapping == MAP_FAILED) {
+            throw MapFailedException("snapshot heap", errno);
+        }
+
+        heap_mapping = static_cast<char *>(mapping);
+        heap = heap_mapping + (program->heap_offset - map_offset);
+    }
+
+    for (auto &relocation : program->relocations) {
+        auto slot = reinterpret_cast<Slot *>(
+            (relocation.in_heap ? heap : reinterpret_cast<char *>(globals.data())) + relocation.offset
+        );
+
+        switch (relocation.base) {
+            case Program::Relocation::R_ABSOLUTE:
+                *slot = relocation.value;
+                break;
+            case Program::Relocation::R_GLOBALS:
+                *slot = reinterpret_cast<Slot>(globals.data()) + relocation.value;
+                break;
+            case Program::Relocation::R_HEAP:
+                *slot = reinterpret_cast<Slot>(heap) + relocation.value;
+                break;
+        }
+    }
+}
+
+vm::Context::~Context()
+{
+    if (heap_mapping) {
+        munmap(heap_mapping, heap_mapping_size);
+    }
+}
+
+void *
+vm::Context::newObject(Context *context, size_t size)
+{ return context->jit_state.allocator.allocate(size); }
+
+void
+vm::Context::stackOverflow(Context *context)
+{
+    StackOverflowException e(
+        "VM stack",
+        context->frames.size() ? context->frames.back().func->name : "",
+        context->stack.size()
+    );
+    if (context->jit_depth) {
+        context->fatal(e);
+    }
+    throw e;
+}
+
+/**
+ * Generated code has no unwind information, so the exception can't be thrown through it
+ *
+ * Compiled callees called directly push no Frame, so func is the function overflowing.
+ */
+void
+vm::Context::jitStackOverflow(Context *context, const VMFunction *func)
+{ context->fatal(StackOverflowException("VM stack", func->name, context->stack.size())); }
+
+void
+vm::Context::registerStackOverflow(Context *context, const VMFunction *func)
+{
+    StackOverflowException e(
+        "register stack",
+        func->name,
+        RegisterStack::MAX_CHUNKS * RegisterStack::CHUNK_SLOTS * sizeof(Slot)
+    );
+    if (context->jit_depth) {
+        context->fatal(e);
+    }
+    throw e;
+}
+
+/**
+ * Compiled code calls compiled code on the host stack, func is the caller running out of it
+ */
+void
+vm::Context::nativeStackOverflow(Context *context, const VMFunction *func)
+{
+    StackOverflowException e("native stack", func->name, context->native_stack_size);
+    if (context->jit_depth) {
+        context->fatal(e);
+    }
+    throw e;
+}
+
+void
+vm::Context::fatal(const std::exception &e)
+{
+    fatal_handler(e);
+    std::abort();
+}
+
+void
+vm::Context::defaultFatalHandler(const std::exception &e)
+{ std::cerr << "ERR!: " << e.what() << std::endl; }
 
+vm::Slot
+vm::Context::run()
+{
 #if CYAN_USE_COMPUTED_GOTO
     static void *DISPATCH_TABLE[] = {
         &&UNKNOWN,
@@ -826,10 +1959,19 @@ vm::VirtualMachine::run()
         &&BNR,
         &&GLOB,
         &&JUMP,
+        &&LC,
         &&LI,
         &&ADD,
+        &&ADDI,
         &&ALLOC,
         &&AND,
+        &&ANDI,
+        &&BEQ,
+        &&BLE,
+        &&BLEU,
+        &&BLT,
+        &&BLTU,
+        &&BNE,
         &&CALL,
         &&DELETE,
         &&DIV,
@@ -850,17 +1992,22 @@ vm::VirtualMachine::run()
         &&NEW,
         &&NOR,
         &&OR,
-        &&POP,
-        &&PUSH,
+        &&ORI,
         &&RET,
         &&SEQ,
+        &&SEQI,
         &&SHL,
+        &&SHLI,
         &&SHLU,
         &&SHR,
+        &&SHRI,
         &&SHRU,
+        &&SHRUI,
         &&SLE,
         &&SLEU,
         &&SLT,
+        &&SLTI,
+        &&SLTIU,
         &&SLTU,
         &&STORE8,
         &&STORE8U,
@@ -872,7 +2019,64 @@ vm::VirtualMachine::run()
         &&STORE64U,
         &&SUB,
         &&XOR,
+        &&XORI,
     };
+#endif
+
+    // without a frame to run, only resolve the threaded code
+    if (frames.empty()) {
+#if CYAN_USE_COMPUTED_GOTO
+        program->threadCode(DISPATCH_TABLE);
+#else
+        program->threadCode(nullptr);
+#endif
+        return 0;
+    }
+
+    auto base_depth = frames.size() - 1;
+    Frame *current_frame = &frames.back();
+    auto pc = current_frame->pc;
+    auto inst = pc;
+    Slot ret_val;
+
+#if CYAN_COMPACT_INSTRUCTION
+#define VM_HANDLER(inst)        DISPATCH_TABLE[(inst)->i_op]
+#define VM_TARGET(index)        (current_frame->func->threaded_list.data() + (index))
+#else
+#define VM_HANDLER(inst)        (inst)->handler
+#define VM_TARGET(index)        inst->target
+#endif
+
+#if CYAN_USE_COMPUTED_GOTO
+
+#define VM_CASE(label)          label:
+#define VM_DISPATCH()                       \
+    do {                                    \
+        inst = pc++;                        \
+        goto *VM_HANDLER(inst);             \
+    } while(false)
+
+#else
+
+#define VM_CASE(label)          case I_##label:
+#define VM_DISPATCH()           break
+
+#endif
+
+// a hot loop continues in compiled code from its header, which then returns for the frame
+#define VM_BRANCH(index)                                                    \
+    do {                                                                    \
+        auto target = VM_TARGET(index);                                     \
+        if (target <= inst && countBackEdge(current_frame->func) &&         \
+                enterCompiled(current_frame, target, ret_val)) {            \
+            current_frame = &frames.back();                                 \
+            goto vm_return;                                                 \
+        }                                                                   \
+        pc = target;                                                        \
+    } while (false)
+
+#if CYAN_USE_COMPUTED_GOTO
+    VM_DISPATCH();
 #else
     while (true) {
         inst = pc++;
@@ -881,21 +2085,25 @@ vm::VirtualMachine::run()
 #endif
             VM_CASE(ARG)
                 {
-                    (*current_frame)[inst->i_rd] = reinterpret_cast<Slot>(
-                            stack.data() + current_frame->frame_pointer + inst->i_imm * CYAN_PRODUCT_BYTES);
+                    if (stack_pointer < CYAN_PRODUCT_BYTES) {
+                        stackOverflow(this);
+                    }
+                    auto address = reinterpret_cast<Slot*>(stack.data() + (stack_pointer -= CYAN_PRODUCT_BYTES));
+                    *address = (*current_frame)[inst->i_imm + 1];
+                    (*current_frame)[inst->i_rd] = reinterpret_cast<Slot>(address);
                     VM_DISPATCH();
                 }
             VM_CASE(BR)
                 {
                     if ((*current_frame)[inst->i_rd]) {
-                        pc = current_frame->func->inst_list.data() + inst->i_imm;
+                        VM_BRANCH(inst->i_imm);
                     }
                     VM_DISPATCH();
                 }
             VM_CASE(BNR)
                 {
                     if (!(*current_frame)[inst->i_rd]) {
-                        pc = current_frame->func->inst_list.data() + inst->i_imm;
+                        VM_BRANCH(inst->i_imm);
                     }
                     VM_DISPATCH();
                 }
@@ -907,12 +2115,17 @@ vm::VirtualMachine::run()
                 }
             VM_CASE(JUMP)
                 {
-                    pc = current_frame->func->inst_list.data() + inst->i_imm;
+                    VM_BRANCH(inst->i_imm);
+                    VM_DISPATCH();
+                }
+            VM_CASE(LC)
+                {
+                    (*current_frame)[inst->i_rd] = current_frame->func->constant_pool[inst->i_imm];
                     VM_DISPATCH();
                 }
             VM_CASE(LI)
                 {
-                    (*current_frame)[inst->i_rd] = inst->i_imm;
+                    (*current_frame)[inst->i_rd] = static_cast<Slot>(static_cast<SignedImmediateT>(inst->i_imm));
                     VM_DISPATCH();
                 }
             VM_CASE(ADD)
@@ -921,9 +2134,17 @@ vm::VirtualMachine::run()
                                                   ((*current_frame)[inst->i_rt] << inst->i_shift);
                     VM_DISPATCH();
                 }
+            VM_CASE(ADDI)
+                {
+                    (*current_frame)[inst->i_rd] = (*current_frame)[inst->i_rs] + inst->i_simm;
+                    VM_DISPATCH();
+                }
             VM_CASE(ALLOC)
                 {
                     auto slots = (*current_frame)[inst->i_rs];
+                    if (slots > stack_pointer / CYAN_PRODUCT_BYTES) {
+                        stackOverflow(this);
+                    }
                     (*current_frame)[inst->i_rd] = reinterpret_cast<Slot>(
                             stack.data() + (stack_pointer -= slots * CYAN_PRODUCT_BYTES)
                         );
@@ -935,25 +2156,87 @@ vm::VirtualMachine::run()
                                                    (*current_frame)[inst->i_rt];
                     VM_DISPATCH();
                 }
+            VM_CASE(ANDI)
+                {
+                    (*current_frame)[inst->i_rd] = (*current_frame)[inst->i_rs] & static_cast<Slot>(static_cast<SignedSlot>(inst->i_simm));
+                    VM_DISPATCH();
+                }
+            VM_CASE(BEQ)
+                {
+                    if ((*current_frame)[inst->i_rs] == (*current_frame)[inst->i_rt]) {
+                        VM_BRANCH(inst->i_target);
+                    }
+                    VM_DISPATCH();
+                }
+            VM_CASE(BLE)
+                {
+                    if (static_cast<SignedSlot>((*current_frame)[inst->i_rs]) <=
+                        static_cast<SignedSlot>((*current_frame)[inst->i_rt])) {
+                        VM_BRANCH(inst->i_target);
+                    }
+                    VM_DISPATCH();
+                }
+            VM_CASE(BLEU)
+                {
+                    if ((*current_frame)[inst->i_rs] <= (*current_frame)[inst->i_rt]) {
+                        VM_BRANCH(inst->i_target);
+                    }
+                    VM_DISPATCH();
+                }
+            VM_CASE(BLT)
+                {
+                    if (static_cast<SignedSlot>((*current_frame)[inst->i_rs]) <
+                        static_cast<SignedSlot>((*current_frame)[inst->i_rt])) {
+                        VM_BRANCH(inst->i_target);
+                    }
+                    VM_DISPATCH();
+                }
+            VM_CASE(BLTU)
+                {
+                    if ((*current_frame)[inst->i_rs] < (*current_frame)[inst->i_rt]) {
+                        VM_BRANCH(inst->i_target);
+                    }
+                    VM_DISPATCH();
+                }
+            VM_CASE(BNE)
+                {
+                    if ((*current_frame)[inst->i_rs] != (*current_frame)[inst->i_rt]) {
+                        VM_BRANCH(inst->i_target);
+                    }
+                    VM_DISPATCH();
+                }
             VM_CASE(CALL)
                 {
                     auto func = reinterpret_cast<Function*>((*current_frame)[inst->i_rs]);
-                    if (dynamic_cast<VMFunction*>(func)) {
-                        auto vm_func = dynamic_cast<VMFunction*>(func);
-                        frame_stack.emplace(new Frame(vm_func, stack_pointer));
-                        current_frame->pc = pc - 1;
-                        current_frame = frame_stack.top().get();
-                        pc = current_frame->pc;
+                    auto window = current_frame->regs + inst->i_rt;
+                    if (func->kind == Function::K_VM) {
+                        auto vm_func = static_cast<VMFunction*>(func);
+                        countCall(vm_func);
+                        if (vm_func->jit_code.load(std::memory_order_acquire)) {
+                            auto ret_val = call_func(this, window, vm_func, stack.data() + stack_pointer, inst->i_shift);
+                            current_frame = &frames.back();
+                            (*current_frame)[inst->i_rd] = ret_val;
+                        }
+                        else {
+                            current_frame->pc = pc - 1;
+                            current_frame = pushFrame(vm_func, window, inst->i_shift, stack_pointer);
+                            pc = current_frame->pc;
+                        }
                     }
                     else {
-                        auto lib_func = dynamic_cast<LibFunction*>(func);
-                        (*current_frame)[inst->i_rd] = lib_func->call(reinterpret_cast<const Slot *>(stack.data() + stack_pointer));
+                        auto lib_func = static_cast<LibFunction*>(func);
+
+                        // a native calling back through Context::call may grow frames
+                        jit_state.host_window = window + 1 + inst->i_shift;
+                        auto ret_val = lib_func->call(window + 1);
+                        current_frame = &frames.back();
+                        (*current_frame)[inst->i_rd] = ret_val;
                     }
                     VM_DISPATCH();
                 }
             VM_CASE(DELETE)
                 {
-                    std::free(reinterpret_cast<void*>((*current_frame)[inst->i_rs]));
+                    deleteObject(this, reinterpret_cast<void*>((*current_frame)[inst->i_rs]));
                     VM_DISPATCH();
                 }
             VM_CASE(DIV)
@@ -970,42 +2253,42 @@ vm::VirtualMachine::run()
                 }
             VM_CASE(LOAD8)
                 {
-                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const int8_t*>((*current_frame)[inst->i_rs]);
+                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const int8_t*>((*current_frame)[inst->i_rs] + inst->i_simm);
                     VM_DISPATCH();
                 }
             VM_CASE(LOAD8U)
                 {
-                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const uint8_t*>((*current_frame)[inst->i_rs]);
+                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const uint8_t*>((*current_frame)[inst->i_rs] + inst->i_simm);
                     VM_DISPATCH();
                 }
             VM_CASE(LOAD16)
                 {
-                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const int16_t*>((*current_frame)[inst->i_rs]);
+                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const int16_t*>((*current_frame)[inst->i_rs] + inst->i_simm);
                     VM_DISPATCH();
                 }
             VM_CASE(LOAD16U)
                 {
-                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const uint16_t*>((*current_frame)[inst->i_rs]);
+                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const uint16_t*>((*current_frame)[inst->i_rs] + inst->i_simm);
                     VM_DISPATCH();
                 }
             VM_CASE(LOAD32)
                 {
-                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const int32_t*>((*current_frame)[inst->i_rs]);
+                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const int32_t*>((*current_frame)[inst->i_rs] + inst->i_simm);
                     VM_DISPATCH();
                 }
             VM_CASE(LOAD32U)
                 {
-                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const uint32_t*>((*current_frame)[inst->i_rs]);
+                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const uint32_t*>((*current_frame)[inst->i_rs] + inst->i_simm);
                     VM_DISPATCH();
                 }
             VM_CASE(LOAD64)
                 {
-                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const int64_t*>((*current_frame)[inst->i_rs]);
+                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const int64_t*>((*current_frame)[inst->i_rs] + inst->i_simm);
                     VM_DISPATCH();
                 }
             VM_CASE(LOAD64U)
                 {
-                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const uint64_t*>((*current_frame)[inst->i_rs]);
+                    (*current_frame)[inst->i_rd] = *reinterpret_cast<const uint64_t*>((*current_frame)[inst->i_rs] + inst->i_simm);
                     VM_DISPATCH();
                 }
             VM_CASE(MOD)
@@ -1039,7 +2322,14 @@ vm::VirtualMachine::run()
                 }
             VM_CASE(NEW);
                 {
-                    (*current_frame)[inst->i_rd] = reinterpret_cast<Slot>(std::malloc((*current_frame)[inst->i_rs]));
+                    auto object = jit_state.allocator.allocate((*current_frame)[inst->i_rs]);
+                    if (tracking_heap) {
+                        heap_blocks.emplace(
+                            reinterpret_cast<Slot>(object),
+                            std::make_pair((*current_frame)[inst->i_rs], inst->i_rt)
+                        );
+                    }
+                    (*current_frame)[inst->i_rd] = reinterpret_cast<Slot>(object);
                     VM_DISPATCH();
                 }
             VM_CASE(NOR)
@@ -1054,27 +2344,21 @@ vm::VirtualMachine::run()
                                                    (*current_frame)[inst->i_rt];
                     VM_DISPATCH();
                 }
-            VM_CASE(POP)
-                {
-                    auto slots = inst->i_imm;
-                    stack_pointer += slots * CYAN_PRODUCT_BYTES;
-                    VM_DISPATCH();
-                }
-            VM_CASE(PUSH)
+            VM_CASE(ORI)
                 {
-                    *reinterpret_cast<Slot*>(
-                        stack.data() + (stack_pointer -= CYAN_PRODUCT_BYTES)
-                    ) = (*current_frame)[inst->i_rd];
+                    (*current_frame)[inst->i_rd] = (*current_frame)[inst->i_rs] | static_cast<Slot>(static_cast<SignedSlot>(inst->i_simm));
                     VM_DISPATCH();
                 }
             VM_CASE(RET)
                 {
-                    auto ret_val = (*current_frame)[inst->i_rs];
+                    ret_val = (*current_frame)[inst->i_rs];
+
+                vm_return:
                     stack_pointer = current_frame->frame_pointer;
-                    frame_stack.pop();
-                    if (frame_stack.empty()) { return ret_val; }
+                    popFrame();
+                    if (frames.size() == base_depth) { return ret_val; }
 
-                    current_frame = frame_stack.top().get();
+                    current_frame = &frames.back();
                     pc = current_frame->pc + 1;
                     (*current_frame)[current_frame->pc->i_rd] = ret_val;
                     VM_DISPATCH();
@@ -1085,12 +2369,22 @@ vm::VirtualMachine::run()
                                                    (*current_frame)[inst->i_rt];
                     VM_DISPATCH();
                 }
+            VM_CASE(SEQI)
+                {
+                    (*current_frame)[inst->i_rd] = (*current_frame)[inst->i_rs] == static_cast<Slot>(static_cast<SignedSlot>(inst->i_simm));
+                    VM_DISPATCH();
+                }
             VM_CASE(SHL)
                 {
                     (*current_frame)[inst->i_rd] = static_cast<SignedSlot>((*current_frame)[inst->i_rs]) <<
                                                    static_cast<SignedSlot>((*current_frame)[inst->i_rt]);
                     VM_DISPATCH();
                 }
+            VM_CASE(SHLI)
+                {
+                    (*current_frame)[inst->i_rd] = (*current_frame)[inst->i_rs] << inst->i_simm;
+                    VM_DISPATCH();
+                }
             VM_CASE(SHLU)
                 {
                     (*current_frame)[inst->i_rd] = (*current_frame)[inst->i_rs] <<
@@ -1103,12 +2397,22 @@ vm::VirtualMachine::run()
                                                    static_cast<SignedSlot>((*current_frame)[inst->i_rt]);
                     VM_DISPATCH();
                 }
+            VM_CASE(SHRI)
+                {
+                    (*current_frame)[inst->i_rd] = static_cast<SignedSlot>((*current_frame)[inst->i_rs]) >> inst->i_simm;
+                    VM_DISPATCH();
+                }
             VM_CASE(SHRU)
                 {
                     (*current_frame)[inst->i_rd] = (*current_frame)[inst->i_rs] >>
                                                    (*current_frame)[inst->i_rt];
                     VM_DISPATCH();
                 }
+            VM_CASE(SHRUI)
+                {
+                    (*current_frame)[inst->i_rd] = (*current_frame)[inst->i_rs] >> inst->i_simm;
+                    VM_DISPATCH();
+                }
             VM_CASE(SLE)
                 {
                     (*current_frame)[inst->i_rd] = static_cast<SignedSlot>((*current_frame)[inst->i_rs]) <=
@@ -1127,6 +2431,16 @@ vm::VirtualMachine::run()
                                                    static_cast<SignedSlot>((*current_frame)[inst->i_rt]);
                     VM_DISPATCH();
                 }
+            VM_CASE(SLTI)
+                {
+                    (*current_frame)[inst->i_rd] = static_cast<SignedSlot>((*current_frame)[inst->i_rs]) < inst->i_simm;
+                    VM_DISPATCH();
+                }
+            VM_CASE(SLTIU)
+                {
+                    (*current_frame)[inst->i_rd] = (*current_frame)[inst->i_rs] < static_cast<Slot>(static_cast<SignedSlot>(inst->i_simm));
+                    VM_DISPATCH();
+                }
             VM_CASE(SLTU)
                 {
                     (*current_frame)[inst->i_rd] = (*current_frame)[inst->i_rs] <
@@ -1135,42 +2449,42 @@ vm::VirtualMachine::run()
                 }
             VM_CASE(STORE8)
                 {
-                    *reinterpret_cast<int8_t*>((*current_frame)[inst->i_rs]) = (*current_frame)[inst->i_rt];
+                    *reinterpret_cast<int8_t*>((*current_frame)[inst->i_rs] + inst->i_simm) = (*current_frame)[inst->i_rd];
                     VM_DISPATCH();
                 }
             VM_CASE(STORE8U)
                 {
-                    *reinterpret_cast<uint8_t*>((*current_frame)[inst->i_rs]) = (*current_frame)[inst->i_rt];
+                    *reinterpret_cast<uint8_t*>((*current_frame)[inst->i_rs] + inst->i_simm) = (*current_frame)[inst->i_rd];
                     VM_DISPATCH();
                 }
             VM_CASE(STORE16)
                 {
-                    *reinterpret_cast<int16_t*>((*current_frame)[inst->i_rs]) = (*current_frame)[inst->i_rt];
+                    *reinterpret_cast<int16_t*>((*current_frame)[inst->i_rs] + inst->i_simm) = (*current_frame)[inst->i_rd];
                     VM_DISPATCH();
                 }
             VM_CASE(STORE16U)
                 {
-                    *reinterpret_cast<uint16_t*>((*current_frame)[inst->i_rs]) = (*current_frame)[inst->i_rt];
+                    *reinterpret_cast<uint16_t*>((*current_frame)[inst->i_rs] + inst->i_simm) = (*current_frame)[inst->i_rd];
                     VM_DISPATCH();
                 }
             VM_CASE(STORE32)
                 {
-                    *reinterpret_cast<int32_t*>((*current_frame)[inst->i_rs]) = (*current_frame)[inst->i_rt];
+                    *reinterpret_cast<int32_t*>((*current_frame)[inst->i_rs] + inst->i_simm) = (*current_frame)[inst->i_rd];
                     VM_DISPATCH();
                 }
             VM_CASE(STORE32U)
                 {
-                    *reinterpret_cast<uint32_t*>((*current_frame)[inst->i_rs]) = (*current_frame)[inst->i_rt];
+                    *reinterpret_cast<uint32_t*>((*current_frame)[inst->i_rs] + inst->i_simm) = (*current_frame)[inst->i_rd];
                     VM_DISPATCH();
                 }
             VM_CASE(STORE64)
                 {
-                    *reinterpret_cast<int64_t*>((*current_frame)[inst->i_rs]) = (*current_frame)[inst->i_rt];
+                    *reinterpret_cast<int64_t*>((*current_frame)[inst->i_rs] + inst->i_simm) = (*current_frame)[inst->i_rd];
                     VM_DISPATCH();
                 }
             VM_CASE(STORE64U)
                 {
-                    *reinterpret_cast<uint64_t*>((*current_frame)[inst->i_rs]) = (*current_frame)[inst->i_rt];
+                    *reinterpret_cast<uint64_t*>((*current_frame)[inst->i_rs] + inst->i_simm) = (*current_frame)[inst->i_rd];
                     VM_DISPATCH();
                 }
             VM_CASE(SUB)
@@ -1185,6 +2499,11 @@ vm::VirtualMachine::run()
                                                    (*current_frame)[inst->i_rt];
                     VM_DISPATCH();
                 }
+            VM_CASE(XORI)
+                {
+                    (*current_frame)[inst->i_rd] = (*current_frame)[inst->i_rs] ^ static_cast<Slot>(static_cast<SignedSlot>(inst->i_simm));
+                    VM_DISPATCH();
+                }
 #if CYAN_USE_COMPUTED_GOTO
             UNKNOWN:
                 assert(false);
@@ -1196,116 +2515,585 @@ vm::VirtualMachine::run()
 #endif
 }
 
+void
+vm::Program::threadCode(void *const *dispatch_table) const
+{
+    for (auto &func_pair : functions) {
+        if (func_pair.second->kind != Function::K_VM) { continue; }
+        auto vm_func = static_cast<VMFunction*>(func_pair.second.get());
+
+        vm_func->threaded_list.clear();
+        vm_func->threaded_list.reserve(vm_func->code().size());
+        for (auto &inst : vm_func->code()) {
+            vm_func->threaded_list.emplace_back(inst);
+        }
+
+#if !CYAN_COMPACT_INSTRUCTION
+        auto base = vm_func->threaded_list.data();
+        for (auto &inst : vm_func->threaded_list) {
+            if (dispatch_table) {
+                inst.handler = dispatch_table[inst.i_op];
+            }
+
+            if (inst.i_op == I_BR || inst.i_op == I_BNR || inst.i_op == I_JUMP) {
+                inst.target = base + inst.i_imm;
+            }
+            else if (inst.i_op >= I_BEQ && inst.i_op <= I_BNE) {
+                inst.target = base + inst.i_target;
+            }
+        }
+#endif
+    }
+}
+
+void
+vm::Context::setup()
+{
+    assert(!ready || !jit);
+    std::call_once(program->threaded, [this] () { run(); });  // no frame yet, threads the code
+
+    if (!initialized) {
+        assert(program->functions.at("_init_")->kind == Function::K_VM);
+        auto init_func = static_cast<VMFunction*>(program->functions.at("_init_").get());
+        pushFrame(init_func, register_stack.bottom(), 0, stack_pointer);
+        run();
+        initialized = true;
+    }
+    ready = true;
+}
+
 vm::Slot
-vm::VirtualMachine::start()
+vm::Context::start()
 {
-    auto init_func = dynamic_cast<VMFunction*>(functions.at("_init_").get());
-    assert(init_func);
-    frame_stack.emplace(new Frame(init_func, stack_pointer));
-    run();
+    setup();
 
-    auto main_func = dynamic_cast<VMFunction*>(functions.at("main").get());
-    assert(main_func);
-    frame_stack.emplace(new Frame(main_func, stack_pointer));
+    assert(program->functions.at("main")->kind == Function::K_VM);
+    auto main_func = static_cast<VMFunction*>(program->functions.at("main").get());
+    pushFrame(main_func, register_stack.bottom(), 0, stack_pointer);
     return run();
 }
 
+vm::Slot
+vm::Context::call(const VMFunction *function, const Slot *arguments, size_t argument_nr)
+{
+    assert(ready);
+    assert(argument_nr == function->argument_nr);
+
+    // above the innermost library call, a host call may come from a library function
+    auto window = frames.empty() ? register_stack.bottom() : jit_state.host_window;
+    auto saved_host_window = jit_state.host_window;
+    std::copy(arguments, arguments + argument_nr, window + 1);
+
+    auto func = const_cast<VMFunction*>(function);
+    if (jit) {
+        auto ret_val = call_func(this, window, func, stack.data() + stack_pointer, argument_nr);
+        jit_state.host_window = saved_host_window;
+        return ret_val;
+    }
+
+    auto depth = frames.size();
+    try {
+        Slot ret_val;
+        if (tiered) {
+            ret_val = call_func(this, window, func, stack.data() + stack_pointer, argument_nr);
+        }
+        else {
+            pushFrame(func, window, argument_nr, stack_pointer);
+            ret_val = run();
+        }
+        jit_state.host_window = saved_host_window;
+        return ret_val;
+    }
+    catch (...) {
+        jit_state.host_window = saved_host_window;
+        // leave the context usable for the next call
+        while (frames.size() > depth) {
+            stack_pointer = frames.back().frame_pointer;
+            popFrame();
+        }
+        throw;
+    }
+}
+
 namespace cyan {
 namespace vm {
 
 Slot
-call_func(VirtualMachine *vm, Slot *arguments, Function *function)
-{
-    if (dynamic_cast<VMFunction*>(function)) {
-        auto vm_func = dynamic_cast<VMFunction*>(function);
-        vm->frame_stack.emplace(new Frame(vm_func, 0));
-
-        auto jit = vm->jit_results.at(function).get();
-        auto func = jit->getCode<JITFunction*>();
-        auto ret = func(
-            vm,
-            vm->frame_stack.top()->regs.data(),
-            reinterpret_cast<char*>(arguments),
-            vm->globals.data()
+call_func(Context *context, Slot *window, Function *function, char *stack_top, size_t arguments)
+{
+    if (function->kind == Function::K_VM) {
+        auto vm_func = static_cast<VMFunction*>(function);
+        context->countCall(vm_func);
+        auto jit_code = vm_func->jit_code.load(std::memory_order_acquire);
+        if (!jit_code) {
+            return context->interpret(vm_func, window, arguments, stack_top);
+        }
+
+        // compiled callers reach here through slow calls, recursing on the host stack as well
+        if (static_cast<char *>(__builtin_frame_address(0)) < context->jit_state.native_stack_limit) {
+            Context::nativeStackOverflow(context, vm_func);
+        }
+
+        auto frame = context->pushFrame(vm_func, window, arguments, 0);
+        ++context->jit_depth;
+        auto ret = jit_code(
+            &context->jit_state,
+            frame->regs,
+            context->stack.data(),
+            context->globals.data(),
+            stack_top
         );
+        --context->jit_depth;
 
-        vm->frame_stack.pop();
+        context->popFrame();
         return ret;
     }
     else {
-        auto lib_func = dynamic_cast<LibFunction*>(function);
-        return lib_func->call(arguments);
+        auto lib_func = static_cast<LibFunction*>(function);
+        context->jit_state.host_window = window + 1 + arguments;
+        return lib_func->call(window + 1);
     }
 };
 
 }
 }
 
+/**
+ * Compiled code calls itself on the host stack, stop it short of the stack of this thread
+ */
+void
+vm::Context::limitNativeStack()
+{
+    pthread_attr_t attributes;
+    void *stack_low;
+    size_t stack_size;
+
+    if (pthread_getattr_np(pthread_self(), &attributes)) {
+        return;
+    }
+    if (!pthread_attr_getstack(&attributes, &stack_low, &stack_size) && stack_size > NATIVE_STACK_RESERVE) {
+        jit_state.native_stack_limit = static_cast<char *>(stack_low) + NATIVE_STACK_RESERVE;
+        native_stack_size = stack_size;
+    }
+    pthread_attr_destroy(&attributes);
+}
+
+void
+vm::Context::setupJIT()
+{
+    assert(!ready || jit);
+    // compiled frames too start at the threaded code, which another context may be building
+    std::call_once(program->threaded, [this] () { run(); });
+    std::call_once(program->compiled, [this] () { program->compileJIT(); });
+
+    limitNativeStack();
+    if (!initialized) {
+        call_func(this, register_stack.bottom(), program->functions.at("_init_").get(), stack.data() + stack_pointer, 0);
+        initialized = true;
+    }
+    ready = true;
+    jit = true;
+}
+
+vm::Slot
+vm::Context::startJIT()
+{
+    setupJIT();
+    return call_func(this, register_stack.bottom(), program->functions.at("main").get(), stack.data() + stack_pointer, 0);
+}
+
+void
+vm::Context::setupTiered(uint32_t call_threshold, uint32_t back_edge_threshold)
+{
+    setup();
+
+    limitNativeStack();
+    this->call_threshold = call_threshold;
+    this->back_edge_threshold = back_edge_threshold;
+    call_counts.assign(program->vm_function_nr, 0);
+    back_edge_counts.assign(program->vm_function_nr, 0);
+    tiered = true;
+}
+
+vm::Slot
+vm::Context::startTiered(uint32_t call_threshold, uint32_t back_edge_threshold)
+{
+    setupTiered(call_threshold, back_edge_threshold);
+    return call_func(this, register_stack.bottom(), program->functions.at("main").get(), stack.data() + stack_pointer, 0);
+}
+
+bool
+vm::Context::enterCompiled(Frame *frame, const ThreadedInstruction *target, Slot &ret_val)
+{
+    auto entry_iter = frame->func->osr_entries.find(target - frame->func->threaded_list.data());
+    if (entry_iter == frame->func->osr_entries.end()) {
+        return false;
+    }
+
+    // registers stay in the window, stack objects of the frame stay above stack_pointer
+    ++jit_depth;
+    ret_val = entry_iter->second(&jit_state, frame->regs, stack.data(), globals.data(), stack.data() + stack_pointer);
+    --jit_depth;
+    return true;
+}
+
 vm::Slot
-vm::VirtualMachine::startJIT()
+vm::Context::interpret(VMFunction *func, Slot *window, size_t arguments, char *stack_top)
+{
+    // below what compiled callers hold on the stack
+    auto saved_stack_pointer = stack_pointer;
+    stack_pointer = stack_top - stack.data();
+    pushFrame(func, window, arguments, stack_pointer);
+    auto ret_val = run();
+    stack_pointer = saved_stack_pointer;
+    return ret_val;
+}
+
+std::map<size_t, const vm::Function *>
+vm::Program::findCallees(const VMFunction *vm_func) const
+{
+    std::map<size_t, const Function *> callees;
+    std::map<RegisterT, size_t> global_of;
+    std::map<RegisterT, const Function *> function_of;
+    std::set<size_t> block_start;
+
+    auto code = vm_func->code();
+    for (auto &inst : code) {
+        if (Generate::isBranch(inst)) {
+            block_start.emplace(Generate::branchTarget(inst));
+        }
+    }
+
+    // a function register loaded from a function slot in the same block
+    for (size_t i = 0; i < code.size(); ++i) {
+        auto inst = code.begin()[i];
+        if (block_start.find(i) != block_start.end()) {
+            global_of.clear();
+            function_of.clear();
+        }
+
+        const Function *loaded = nullptr;
+        if ((inst.i_op == I_LOAD64 || inst.i_op == I_LOAD64U) && !inst.i_simm &&
+                global_of.find(inst.i_rs) != global_of.end() &&
+                global_of.at(inst.i_rs) >= function_slot_base &&
+                global_of.at(inst.i_rs) < function_slot_base + function_slot_nr) {
+            loaded = reinterpret_cast<const Function *>(globals[global_of.at(inst.i_rs)]);
+        }
+        else if (inst.i_op == I_CALL && function_of.find(inst.i_rs) != function_of.end()) {
+            callees.emplace(i, function_of.at(inst.i_rs));
+        }
+
+        if (inst.i_op == I_CALL) {
+            // the callee may write anything from its window on
+            global_of.erase(global_of.lower_bound(inst.i_rt), global_of.end());
+            function_of.erase(function_of.lower_bound(inst.i_rt), function_of.end());
+        }
+        Generate::foreachRegister(inst, [&](RegisterT &reg, bool define) {
+            if (define) {
+                global_of.erase(reg);
+                function_of.erase(reg);
+            }
+        });
+
+        if (inst.i_op == I_GLOB) {
+            global_of[inst.i_rd] = inst.i_imm;
+        }
+        else if (loaded) {
+            function_of[inst.i_rd] = loaded;
+        }
+    }
+
+    return callees;
+}
+
+constexpr int vm::Program::RegisterMap::IN_WINDOW;
+
+vm::Program::RegisterMap
+vm::Program::mapRegisters(const VMFunction *vm_func, size_t host_nr) const
+{
+    auto view = vm_func->code();
+    std::vector<Instruction> code(view.begin(), view.end());
+    auto register_nr = vm_func->register_nr;
+
+    RegisterMap map;
+    map.host.assign(register_nr, RegisterMap::IN_WINDOW);
+    map.interval_start.assign(register_nr, std::numeric_limits<size_t>::max());
+    map.interval_end.assign(register_nr, 0);
+
+    // zero register, call windows and arguments read by ARG are accessed in memory
+    std::vector<bool> in_window(register_nr, false);
+    in_window[0] = true;
+    for (auto &inst : code) {
+        if (inst.i_op == I_CALL) {
+            for (size_t reg = inst.i_rt; reg <= inst.i_rt + inst.i_shift; ++reg) {
+                in_window[reg] = true;
+            }
+        }
+        else if (inst.i_op == I_ARG) {
+            in_window[inst.i_imm + 1] = true;
+        }
+    }
+
+    std::vector<size_t> block_start;
+    std::vector<std::vector<bool> > live_in;
+    std::vector<std::vector<bool> > live_out;
+    Generate::computeLiveness(code, register_nr, block_start, live_in, live_out);
+
+    // instructions inside a backward branch weigh more
+    std::vector<size_t> loop_depth(code.size() + 1, 0);
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (Generate::isBranch(code[i]) && Generate::branchTarget(code[i]) <= i) {
+            for (auto j = Generate::branchTarget(code[i]); j <= i; ++j) {
+                ++loop_depth[j];
+            }
+        }
+    }
+
+    std::vector<size_t> weight(register_nr, 0);
+    std::vector<bool> occurs(register_nr, false);
+    std::vector<bool> in_loop(register_nr, false);
+    auto extend = [&](size_t reg, size_t position) {
+        occurs[reg] = true;
+        map.interval_start[reg] = std::min(map.interval_start[reg], position);
+        map.interval_end[reg] = std::max(map.interval_end[reg], position);
+    };
+
+    for (size_t reg = 1; reg <= vm_func->argument_nr && reg < register_nr; ++reg) {
+        extend(reg, 0);
+    }
+    for (size_t b = 0; b + 1 < block_start.size(); ++b) {
+        for (size_t reg = 0; reg < register_nr; ++reg) {
+            if (live_in[b][reg]) { extend(reg, 2 * block_start[b]); }
+            if (live_out[b][reg]) { extend(reg, 2 * block_start[b + 1]); }
+        }
+        for (auto i = block_start[b]; i < block_start[b + 1]; ++i) {
+            Generate::foreachRegister(code[i], [&](RegisterT &reg, bool define) {
+                extend(reg, 2 * i + (define ? 1 : 0));
+                weight[reg] += static_cast<size_t>(1) << (3 * std::min<size_t>(loop_depth[i], 4));
+                in_loop[reg] = in_loop[reg] || loop_depth[i];
+            });
+        }
+    }
+
+    // outside loops a host register saves less than its save and load at entry cost
+    std::vector<RegisterT> order;
+    for (size_t reg = 0; reg < register_nr; ++reg) {
+        if (occurs[reg] && in_loop[reg] && !in_window[reg]) { order.push_back(static_cast<RegisterT>(reg)); }
+    }
+    std::sort(order.begin(), order.end(), [&](RegisterT a, RegisterT b) {
+        return map.interval_start[a] < map.interval_start[b];
+    });
+
+    // linear scan, the lightest interval goes back to the window when none is free
+    std::set<std::pair<size_t, RegisterT> > active;
+    std::set<int> free_hosts;
+    for (size_t host = 0; host < host_nr; ++host) {
+        free_hosts.insert(static_cast<int>(host));
+    }
+    for (auto reg : order) {
+        while (active.size() && active.begin()->first < map.interval_start[reg]) {
+            free_hosts.insert(map.host[active.begin()->second]);
+            active.erase(active.begin());
+        }
+
+        if (free_hosts.empty()) {
+            auto lightest = active.begin();
+            for (auto iter = active.begin(); iter != active.end(); ++iter) {
+                if (weight[iter->second] < weight[lightest->second]) { lightest = iter; }
+            }
+            if (weight[lightest->second] >= weight[reg]) {
+                continue;
+            }
+            free_hosts.insert(map.host[lightest->second]);
+            map.host[lightest->second] = RegisterMap::IN_WINDOW;
+            active.erase(lightest);
+        }
+
+        map.host[reg] = *free_hosts.begin();
+        free_hosts.erase(free_hosts.begin());
+        active.emplace(map.interval_end[reg], reg);
+    }
+
+    return map;
+}
+
+void
+vm::Program::compileJIT() const
 {
     for (auto &func_pair : functions) {
         if (dynamic_cast<VMFunction*>(func_pair.second.get())) {
-            functionJIT(dynamic_cast<VMFunction*>(func_pair.second.get()));
+            compileFunction(dynamic_cast<VMFunction*>(func_pair.second.get()));
         }
     }
-    call_func(this, reinterpret_cast<Slot *>(stack.data() + stack_pointer), functions.at("_init_").get());
-    return call_func(this, reinterpret_cast<Slot *>(stack.data() + stack_pointer), functions.at("main").get());
 }
 
 void
-vm::VirtualMachine::functionJIT(VMFunction *vm_func)
+vm::Program::compileFunction(VMFunction *vm_func) const
+{
+    std::lock_guard<std::mutex> lock(jit_mutex);
+    if (!vm_func->jit_code.load(std::memory_order_relaxed)) {
+        functionJIT(vm_func);
+    }
+}
+
+void
+vm::Program::functionJIT(VMFunction *vm_func) const
 {
     jit_results[vm_func].reset(new Xbyak::CodeGenerator(4096, Xbyak::AutoGrow));
     auto jit = jit_results.at(vm_func).get();
     std::set<size_t> label_list;
+    auto callees = findCallees(vm_func);
+    std::vector<size_t> entry_labels;
+    std::map<size_t, size_t> osr_offsets;
+
+    static_assert(std::is_standard_layout<JITState>::value, "JIT code reaches JITState by offsetof");
+    constexpr size_t CONTEXT_OFFSET = offsetof(JITState, context);
+    constexpr size_t ALLOCATOR_OFFSET = offsetof(JITState, allocator);
+    constexpr size_t FREE_LISTS_OFFSET = ALLOCATOR_OFFSET + offsetof(ObjectAllocator, free_lists);
+    constexpr size_t BUMP_OFFSET = ALLOCATOR_OFFSET + offsetof(ObjectAllocator, bump);
+    constexpr size_t BUMP_LIMIT_OFFSET = ALLOCATOR_OFFSET + offsetof(ObjectAllocator, bump_limit);
+    constexpr size_t STATS_OFFSET = ALLOCATOR_OFFSET + offsetof(ObjectAllocator, stats);
+    constexpr size_t REGISTER_LIMIT_OFFSET = offsetof(JITState, register_limit);
+    constexpr size_t HOST_WINDOW_OFFSET = offsetof(JITState, host_window);
+    constexpr size_t NATIVE_STACK_LIMIT_OFFSET = offsetof(JITState, native_stack_limit);
 
     /**
-     * RDI  vm
+     * RDI  jit_state of the context
      * RSI  regs
-     * RDX  stack_base (aka. arguments)
+     * RDX  stack_limit
      * RCX  globals
      * R8   stack_top
      */
 
-    for (auto &inst : vm_func->inst_list) {
+    // code compiled on another thread lands in its heap, rel32 may not reach the helpers from there
+    auto call_native = [&](uintptr_t target) {
+        jit->mov(jit->r11, target);
+        jit->call(jit->r11);
+    };
+
+    const Xbyak::Reg64 host_regs[] = { jit->rbx, jit->rbp, jit->r12, jit->r13, jit->r14, jit->r15 };
+    auto register_map = mapRegisters(vm_func, sizeof(host_regs) / sizeof(host_regs[0]));
+
+    std::vector<std::unique_ptr<Xbyak::Operand> > operands;
+    std::set<int> used_hosts;
+    for (size_t reg = 0; reg < vm_func->register_nr; ++reg) {
+        if (register_map.host[reg] != RegisterMap::IN_WINDOW) {
+            operands.emplace_back(new Xbyak::Reg64(host_regs[register_map.host[reg]]));
+            used_hosts.insert(register_map.host[reg]);
+        }
+        else {
+            operands.emplace_back(new Xbyak::Address(jit->qword[jit->rsi + reg * CYAN_PRODUCT_BYTES]));
+        }
+    }
+    auto vreg = [&](size_t reg) -> const Xbyak::Operand & {
+        assert(reg < operands.size());
+        return *operands[reg];
+    };
+
+    // callee-saved registers in use, padded so RSP stays as at entry for the calls in the body
+    std::vector<Xbyak::Reg64> saved_hosts;
+    for (auto host : used_hosts) {
+        saved_hosts.push_back(host_regs[host]);
+    }
+    auto enter = [&](size_t position) {
+        for (auto &host : saved_hosts) {
+            jit->push(host);
+        }
+        if (saved_hosts.size() % 2) {
+            jit->sub(jit->rsp, 8);
+        }
+        for (size_t reg = 0; reg < vm_func->register_nr; ++reg) {
+            if (register_map.host[reg] != RegisterMap::IN_WINDOW && register_map.liveAt(reg, position)) {
+                jit->mov(host_regs[register_map.host[reg]], jit->qword[jit->rsi + reg * CYAN_PRODUCT_BYTES]);
+            }
+        }
+    };
+    auto leave = [&]() {
+        if (saved_hosts.size() % 2) {
+            jit->add(jit->rsp, 8);
+        }
+        for (auto iter = saved_hosts.rbegin(); iter != saved_hosts.rend(); ++iter) {
+            jit->pop(*iter);
+        }
+    };
+
+    // where a two-operand op computes rd from rs: rd's host register, unless the op still reads
+    // rd as rt, otherwise rax, which result() stores back
+    auto operand = [&](size_t rd, size_t rs, size_t rt) -> Xbyak::Reg64 {
+        if (register_map.host[rd] != RegisterMap::IN_WINDOW && (rd == rs || rd != rt)) {
+            auto host = host_regs[register_map.host[rd]];
+            if (rd != rs) {
+                jit->mov(host, vreg(rs));
+            }
+            return host;
+        }
+        jit->mov(jit->rax, vreg(rs));
+        return jit->rax;
+    };
+    auto result = [&](size_t rd, const Xbyak::Reg64 &reg) {
+        if (reg.getIdx() == jit->rax.getIdx()) {
+            jit->mov(vreg(rd), jit->rax);
+        }
+    };
+
+    for (auto &inst : vm_func->code()) {
         if (inst.i_op == I_BR || inst.i_op == I_BNR || inst.i_op == I_JUMP) {
             label_list.emplace(inst.i_imm);
         }
+        else if (inst.i_op >= I_BEQ && inst.i_op <= I_BNE) {
+            label_list.emplace(inst.i_target);
+        }
     }
 
-    jit->mov(jit->r8, jit->rdx);
+    // a callee making no calls can't recurse, its frame fits in Context::NATIVE_STACK_RESERVE
+    auto makes_calls = [](const VMFunction *callee) {
+        auto callee_code = callee->code();
+        return std::any_of(callee_code.begin(), callee_code.end(), [](const Instruction &inst) {
+            return inst.i_op == I_CALL;
+        });
+    };
+
+    // recursive calls come in here
+    jit->L("entry");
+    enter(0);
+
     size_t counter = 0;
-    for (auto &inst : vm_func->inst_list) {
-        if (label_list.size()) {
-            if (counter++ == *label_list.begin()) {
-                jit->L(std::to_string(*label_list.begin()));
-                label_list.erase(label_list.begin());
-            }
+    for (auto &inst : vm_func->code()) {
+        auto index = counter++;
+        if (label_list.size() && index == *label_list.begin()) {
+            jit->L(std::to_string(*label_list.begin()));
+            label_list.erase(label_list.begin());
+            entry_labels.push_back(index);
         }
         switch (inst.i_op) {
             case I_ARG:
                 {
-                    jit->lea(jit->rax, jit->qword[jit->rdx + inst.i_imm * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(jit->r9, jit->r8);
+                    jit->sub(jit->r9, jit->rdx);
+                    jit->cmp(jit->r9, CYAN_PRODUCT_BYTES);
+                    jit->jb("stack_overflow", jit->T_NEAR);
+                    jit->mov(jit->rax, vreg(inst.i_imm + 1));
+                    jit->sub(jit->r8, CYAN_PRODUCT_BYTES);
+                    jit->mov(jit->qword[jit->r8], jit->rax);
+                    jit->mov(vreg(inst.i_rd), jit->r8);
                     break;
                 }
             case I_BR:
                 {
-                    jit->cmp(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], 0);
+                    jit->cmp(vreg(inst.i_rd), 0);
                     jit->jne(std::to_string(inst.i_imm), jit->T_NEAR);
                     break;
                 }
             case I_BNR:
                 {
-                    jit->cmp(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], 0);
+                    jit->cmp(vreg(inst.i_rd), 0);
                     jit->je(std::to_string(inst.i_imm), jit->T_NEAR);
                     break;
                 }
             case I_GLOB:
                 {
                     jit->lea(jit->rax, jit->qword[jit->rcx + inst.i_imm * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
                     break;
                 }
             case I_JUMP:
@@ -1313,45 +3101,216 @@ vm::VirtualMachine::functionJIT(VMFunction *vm_func)
                     jit->jmp(std::to_string(inst.i_imm), jit->T_NEAR);
                     break;
                 }
+            case I_LC:
+                {
+                    jit->mov(jit->rax, vm_func->constant_pool[inst.i_imm]);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
+                    break;
+                }
             case I_LI:
                 {
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], inst.i_imm);
+                    auto value = static_cast<SignedImmediateT>(inst.i_imm);
+                    if (value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max()) {
+                        jit->mov(vreg(inst.i_rd), static_cast<uint64_t>(value));
+                    }
+                    else {
+                        jit->mov(jit->rax, static_cast<uint64_t>(value));
+                        jit->mov(vreg(inst.i_rd), jit->rax);
+                    }
                     break;
                 }
             case I_ADD:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
+                    if (!inst.i_shift) {
+                        auto reg = operand(inst.i_rd, inst.i_rs, inst.i_rt);
+                        jit->add(reg, vreg(inst.i_rt));
+                        result(inst.i_rd, reg);
+                        break;
+                    }
+                    jit->mov(jit->rax, vreg(inst.i_rt));
                     if (inst.i_shift) {
                         jit->sal(jit->rax, inst.i_shift);
                     }
-                    jit->add(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->add(jit->rax, vreg(inst.i_rs));
+                    jit->mov(vreg(inst.i_rd), jit->rax);
+                    break;
+                }
+            case I_ADDI:
+                {
+                    auto reg = operand(inst.i_rd, inst.i_rs, inst.i_rs);
+                    jit->add(reg, inst.i_simm);
+                    result(inst.i_rd, reg);
                     break;
                 }
             case I_ALLOC:
                 {
-                    jit->sub(jit->r8, inst.i_imm * CYAN_PRODUCT_BYTES);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->r8);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->mov(jit->r9, jit->r8);
+                    jit->sub(jit->r9, jit->rdx);
+                    jit->shr(jit->r9, __builtin_ctz(CYAN_PRODUCT_BYTES));
+                    jit->cmp(jit->rax, jit->r9);
+                    jit->ja("stack_overflow", jit->T_NEAR);
+                    jit->shl(jit->rax, __builtin_ctz(CYAN_PRODUCT_BYTES));
+                    jit->sub(jit->r8, jit->rax);
+                    jit->mov(vreg(inst.i_rd), jit->r8);
                     break;
                 }
             case I_AND:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->and(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    auto reg = operand(inst.i_rd, inst.i_rs, inst.i_rt);
+                    jit->and(reg, vreg(inst.i_rt));
+                    result(inst.i_rd, reg);
+                    break;
+                }
+            case I_ANDI:
+                {
+                    auto reg = operand(inst.i_rd, inst.i_rs, inst.i_rs);
+                    jit->and(reg, inst.i_simm);
+                    result(inst.i_rd, reg);
+                    break;
+                }
+            case I_BEQ:
+                {
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, vreg(inst.i_rt));
+                    jit->je(std::to_string(inst.i_target), jit->T_NEAR);
+                    break;
+                }
+            case I_BLE:
+                {
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, vreg(inst.i_rt));
+                    jit->jle(std::to_string(inst.i_target), jit->T_NEAR);
+                    break;
+                }
+            case I_BLEU:
+                {
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, vreg(inst.i_rt));
+                    jit->jbe(std::to_string(inst.i_target), jit->T_NEAR);
+                    break;
+                }
+            case I_BLT:
+                {
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, vreg(inst.i_rt));
+                    jit->jl(std::to_string(inst.i_target), jit->T_NEAR);
+                    break;
+                }
+            case I_BLTU:
+                {
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, vreg(inst.i_rt));
+                    jit->jb(std::to_string(inst.i_target), jit->T_NEAR);
+                    break;
+                }
+            case I_BNE:
+                {
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, vreg(inst.i_rt));
+                    jit->jne(std::to_string(inst.i_target), jit->T_NEAR);
                     break;
                 }
             case I_CALL:
                 {
+                    auto callee_iter = callees.find(index);
+                    if (callee_iter != callees.end() && callee_iter->second->kind == Function::K_LIB) {
+                        auto lib_func = static_cast<const LibFunction*>(callee_iter->second);
+                        if (lib_func->direct && lib_func->argument_nr == inst.i_shift) {
+                            static const Xbyak::Reg64 ARGUMENT_REGS[] = {
+                                jit->rdi, jit->rsi, jit->rdx, jit->rcx, jit->r8, jit->r9
+                            };
+                            static_assert(
+                                sizeof(ARGUMENT_REGS) / sizeof(ARGUMENT_REGS[0]) == LibFunction::DIRECT_ARGUMENT_NR,
+                                "every direct argument needs a register"
+                            );
+
+                            jit->push(jit->rdi);
+                            jit->push(jit->rsi);
+                            jit->push(jit->rdx);
+                            jit->push(jit->rcx);
+                            jit->push(jit->r8);
+
+                            jit->lea(jit->rax, jit->qword[jit->rsi + (inst.i_rt + 1 + inst.i_shift) * CYAN_PRODUCT_BYTES]);
+                            jit->mov(jit->qword[jit->rdi + HOST_WINDOW_OFFSET], jit->rax);
+
+                            jit->mov(jit->rax, jit->rsi);
+                            for (size_t i = 0; i < lib_func->argument_nr; ++i) {
+                                jit->mov(ARGUMENT_REGS[i], jit->qword[jit->rax + (inst.i_rt + 1 + i) * CYAN_PRODUCT_BYTES]);
+                            }
+                            call_native(reinterpret_cast<uintptr_t>(lib_func->native));
+                            if (lib_func->returns_void) {
+                                jit->xor(jit->eax, jit->eax);
+                            }
+
+                            jit->pop(jit->r8);
+                            jit->pop(jit->rcx);
+                            jit->pop(jit->rdx);
+                            jit->pop(jit->rsi);
+                            jit->pop(jit->rdi);
+
+                            jit->mov(vreg(inst.i_rd), jit->rax);
+                            break;
+                        }
+                    }
+
+                    // a compiled VM callee is called directly, its window needs no new chunk
+                    auto slow_call = "call_" + std::to_string(index);
+                    auto call_done = "call_done_" + std::to_string(index);
+                    auto direct = callee_iter != callees.end() && callee_iter->second->kind == Function::K_VM;
+                    if (direct) {
+                        auto vm_callee = static_cast<const VMFunction*>(callee_iter->second);
+
+                        jit->lea(jit->rax, jit->qword[jit->rsi + (inst.i_rt + vm_callee->register_nr) * CYAN_PRODUCT_BYTES]);
+                        jit->cmp(jit->rax, jit->qword[jit->rdi + REGISTER_LIMIT_OFFSET]);
+                        jit->ja(slow_call, jit->T_NEAR);
+                        if (makes_calls(vm_callee)) {
+                            jit->cmp(jit->rsp, jit->qword[jit->rdi + NATIVE_STACK_LIMIT_OFFSET]);
+                            jit->jb("native_stack_overflow", jit->T_NEAR);
+                        }
+                        if (vm_callee != vm_func) {
+                            // a plain load acquires on x86
+                            jit->mov(jit->rax, reinterpret_cast<uintptr_t>(&vm_callee->jit_code));
+                            jit->mov(jit->rax, jit->qword[jit->rax]);
+                            jit->test(jit->rax, jit->rax);
+                            jit->jz(slow_call, jit->T_NEAR);
+                        }
+
+                        // callees keep rdi, rdx and rcx, the third push realigns the stack
+                        jit->push(jit->rsi);
+                        jit->push(jit->rcx);
+                        jit->push(jit->r8);
+
+                        jit->mov(jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES], 0);
+                        jit->lea(jit->rsi, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
+                        if (vm_callee != vm_func) {
+                            jit->call(jit->rax);
+                        }
+                        else {
+                            jit->call("entry");
+                        }
+
+                        jit->pop(jit->r8);
+                        jit->pop(jit->rcx);
+                        jit->pop(jit->rsi);
+
+                        jit->mov(vreg(inst.i_rd), jit->rax);
+                        jit->jmp(call_done, jit->T_NEAR);
+                        jit->L(slow_call);
+                    }
+
                     jit->push(jit->rdi);
                     jit->push(jit->rsi);
                     jit->push(jit->rdx);
                     jit->push(jit->rcx);
                     jit->push(jit->r8);
 
-                    jit->mov(jit->rdx, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->rsi, jit->r8);
-                    jit->call(call_func);
+                    jit->mov(jit->rdx, vreg(inst.i_rs));
+                    jit->lea(jit->rsi, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
+                    jit->mov(jit->rcx, jit->r8);
+                    jit->mov(jit->r8, inst.i_shift);
+                    jit->mov(jit->rdi, jit->qword[jit->rdi + CONTEXT_OFFSET]);
+                    call_native(reinterpret_cast<uintptr_t>(call_func));
 
                     jit->pop(jit->r8);
                     jit->pop(jit->rcx);
@@ -1359,7 +3318,10 @@ vm::VirtualMachine::functionJIT(VMFunction *vm_func)
                     jit->pop(jit->rsi);
                     jit->pop(jit->rdi);
 
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
+                    if (direct) {
+                        jit->L(call_done);
+                    }
                     break;
                 }
             case I_DELETE:
@@ -1370,8 +3332,9 @@ vm::VirtualMachine::functionJIT(VMFunction *vm_func)
                     jit->push(jit->rcx);
                     jit->push(jit->r8);
 
-                    jit->mov(jit->rdi, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->call(std::free);
+                    jit->mov(jit->rsi, vreg(inst.i_rs));
+                    jit->mov(jit->rdi, jit->qword[jit->rdi + CONTEXT_OFFSET]);
+                    call_native(reinterpret_cast<uintptr_t>(Context::deleteObject));
 
                     jit->pop(jit->r8);
                     jit->pop(jit->rcx);
@@ -1385,9 +3348,9 @@ vm::VirtualMachine::functionJIT(VMFunction *vm_func)
                     jit->push(jit->rdx);
 
                     jit->xor(jit->rdx, jit->rdx);
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->idiv(jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->idiv(vreg(inst.i_rt));
+                    jit->mov(vreg(inst.i_rd), jit->rax);
 
                     jit->pop(jit->rdx);
                     break;
@@ -1397,67 +3360,67 @@ vm::VirtualMachine::functionJIT(VMFunction *vm_func)
                     jit->push(jit->rdx);
 
                     jit->xor(jit->rdx, jit->rdx);
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->div(jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->div(vreg(inst.i_rt));
+                    jit->mov(vreg(inst.i_rd), jit->rax);
 
                     jit->pop(jit->rdx);
                     break;
                 }
             case I_LOAD8:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->movsx(jit->rax, jit->byte[jit->rax]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->movsx(jit->rax, jit->byte[jit->rax + inst.i_simm]);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
                     break;
                 }
             case I_LOAD8U:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->movzx(jit->rax, jit->byte[jit->rax]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->movzx(jit->rax, jit->byte[jit->rax + inst.i_simm]);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
                     break;
                 }
             case I_LOAD16:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->movsx(jit->rax, jit->word[jit->rax]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->movsx(jit->rax, jit->word[jit->rax + inst.i_simm]);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
                     break;
                 }
             case I_LOAD16U:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->movzx(jit->rax, jit->word[jit->rax]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->movzx(jit->rax, jit->word[jit->rax + inst.i_simm]);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
                     break;
                 }
             case I_LOAD32:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->movsxd(jit->rax, jit->dword[jit->rax]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->movsxd(jit->rax, jit->dword[jit->rax + inst.i_simm]);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
                     break;
                 }
             case I_LOAD32U:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->movzx(jit->rax, jit->dword[jit->rax]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->movzx(jit->rax, jit->dword[jit->rax + inst.i_simm]);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
                     break;
                 }
             case I_LOAD64:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->rax, jit->qword[jit->rax]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->mov(jit->rax, jit->qword[jit->rax + inst.i_simm]);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
                     break;
                 }
             case I_LOAD64U:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->rax, jit->qword[jit->rax]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->mov(jit->rax, jit->qword[jit->rax + inst.i_simm]);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
                     break;
                 }
             case I_MOD:
@@ -1465,9 +3428,9 @@ vm::VirtualMachine::functionJIT(VMFunction *vm_func)
                     jit->push(jit->rdx);
 
                     jit->xor(jit->rdx, jit->rdx);
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->idiv(jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rdx);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->idiv(vreg(inst.i_rt));
+                    jit->mov(vreg(inst.i_rd), jit->rdx);
 
                     jit->pop(jit->rdx);
                     break;
@@ -1477,47 +3440,83 @@ vm::VirtualMachine::functionJIT(VMFunction *vm_func)
                     jit->push(jit->rdx);
 
                     jit->xor(jit->rdx, jit->rdx);
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->div(jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rdx);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->div(vreg(inst.i_rt));
+                    jit->mov(vreg(inst.i_rd), jit->rdx);
 
                     jit->pop(jit->rdx);
                     break;
                 }
             case I_MOV:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd *CYAN_PRODUCT_BYTES], jit->rax);
+                    result(inst.i_rd, operand(inst.i_rd, inst.i_rs, inst.i_rs));
                     break;
                 }
             case I_MUL:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->imul(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd *CYAN_PRODUCT_BYTES], jit->rax);
+                    auto reg = operand(inst.i_rd, inst.i_rs, inst.i_rt);
+                    jit->imul(reg, vreg(inst.i_rt));
+                    result(inst.i_rd, reg);
                     break;
                 }
             case I_MULU:
                 {
                     jit->push(jit->rdx);
 
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mul(jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd *CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->mul(vreg(inst.i_rt));
+                    jit->mov(vreg(inst.i_rd), jit->rax);
 
                     jit->pop(jit->rdx);
                     break;
                 }
             case I_NEW:
                 {
+                    auto slow_label = "new_slow_" + std::to_string(index);
+                    auto bump_label = "new_bump_" + std::to_string(index);
+                    auto found_label = "new_found_" + std::to_string(index);
+                    auto done_label = "new_done_" + std::to_string(index);
+
+                    // r9 size, r10 class, rax block
+                    jit->mov(jit->r9, vreg(inst.i_rs));
+                    jit->cmp(jit->r9, ObjectAllocator::MAX_SMALL_SIZE);
+                    jit->ja(slow_label, jit->T_NEAR);
+                    jit->lea(jit->r10, jit->qword[jit->r9 + (sizeof(Slot) - 1)]);
+                    jit->shr(jit->r10, __builtin_ctz(sizeof(Slot)));
+
+                    jit->mov(jit->rax, jit->qword[jit->rdi + jit->r10 * sizeof(Slot) + FREE_LISTS_OFFSET]);
+                    jit->test(jit->rax, jit->rax);
+                    jit->jz(bump_label, jit->T_NEAR);
+                    jit->mov(jit->r11, jit->qword[jit->rax]);
+                    jit->mov(jit->qword[jit->rdi + jit->r10 * sizeof(Slot) + FREE_LISTS_OFFSET], jit->r11);
+                    jit->jmp(found_label, jit->T_NEAR);
+
+                    jit->L(bump_label);
+                    jit->mov(jit->rax, jit->qword[jit->rdi + BUMP_OFFSET]);
+                    jit->lea(jit->r11, jit->qword[jit->rax + jit->r10 * sizeof(Slot) + sizeof(Slot)]);
+                    jit->cmp(jit->r11, jit->qword[jit->rdi + BUMP_LIMIT_OFFSET]);
+                    jit->ja(slow_label, jit->T_NEAR);
+                    jit->mov(jit->qword[jit->rdi + BUMP_OFFSET], jit->r11);
+
+                    jit->L(found_label);
+                    jit->mov(jit->qword[jit->rax], jit->r10);
+                    jit->add(jit->rax, sizeof(Slot));
+                    jit->add(jit->qword[jit->rdi + STATS_OFFSET + offsetof(ObjectAllocator::Stats, allocations)], 1);
+                    jit->add(jit->qword[jit->rdi + STATS_OFFSET + offsetof(ObjectAllocator::Stats, bytes)], jit->r9);
+                    jit->add(jit->qword[jit->rdi + STATS_OFFSET + offsetof(ObjectAllocator::Stats, live_objects)], 1);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
+                    jit->jmp(done_label, jit->T_NEAR);
+
+                    jit->L(slow_label);
                     jit->push(jit->rdi);
                     jit->push(jit->rsi);
                     jit->push(jit->rdx);
                     jit->push(jit->rcx);
                     jit->push(jit->r8);
 
-                    jit->mov(jit->rdi, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->call(std::malloc);
+                    jit->mov(jit->rdi, jit->qword[jit->rdi + CONTEXT_OFFSET]);
+                    jit->mov(jit->rsi, jit->r9);
+                    call_native(reinterpret_cast<uintptr_t>(Context::newObject));
 
                     jit->pop(jit->r8);
                     jit->pop(jit->rcx);
@@ -1525,39 +3524,36 @@ vm::VirtualMachine::functionJIT(VMFunction *vm_func)
                     jit->pop(jit->rsi);
                     jit->pop(jit->rdi);
 
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
+                    jit->L(done_label);
                     break;
                 }
             case I_NOR:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->or(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->or(jit->rax, vreg(inst.i_rt));
                     jit->not(jit->rax);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
                     break;
                 }
             case I_OR:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->or(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
-                    break;
-                }
-            case I_POP:
-                {
-                    jit->add(jit->r8, inst.i_imm * CYAN_PRODUCT_BYTES);
+                    auto reg = operand(inst.i_rd, inst.i_rs, inst.i_rt);
+                    jit->or(reg, vreg(inst.i_rt));
+                    result(inst.i_rd, reg);
                     break;
                 }
-            case I_PUSH:
+            case I_ORI:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES]);
-                    jit->sub(jit->r8, CYAN_PRODUCT_BYTES);
-                    jit->mov(jit->qword[jit->r8], jit->rax);
+                    auto reg = operand(inst.i_rd, inst.i_rs, inst.i_rs);
+                    jit->or(reg, inst.i_simm);
+                    result(inst.i_rd, reg);
                     break;
                 }
             case I_RET:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    leave();
                     jit->ret();
                     break;
                 }
@@ -1565,32 +3561,49 @@ vm::VirtualMachine::functionJIT(VMFunction *vm_func)
                 {
                     jit->mov(jit->r9, 1);
                     jit->xor(jit->r10, jit->r10);
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->cmp(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, vreg(inst.i_rt));
+                    jit->cmove(jit->r10, jit->r9);
+                    jit->mov(vreg(inst.i_rd), jit->r10);
+                    break;
+                }
+            case I_SEQI:
+                {
+                    jit->mov(jit->r9, 1);
+                    jit->xor(jit->r10, jit->r10);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, inst.i_simm);
                     jit->cmove(jit->r10, jit->r9);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->r10);
+                    jit->mov(vreg(inst.i_rd), jit->r10);
                     break;
                 }
             case I_SHL:
                 {
                     jit->push(jit->rcx);
 
-                    jit->mov(jit->cl, jit->byte[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
+                    jit->mov(jit->rcx, vreg(inst.i_rt));
+                    jit->mov(jit->rax, vreg(inst.i_rs));
                     jit->sal(jit->rax, jit->cl);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
 
                     jit->pop(jit->rcx);
                     break;
                 }
+            case I_SHLI:
+                {
+                    auto reg = operand(inst.i_rd, inst.i_rs, inst.i_rs);
+                    jit->shl(reg, inst.i_simm);
+                    result(inst.i_rd, reg);
+                    break;
+                }
             case I_SHLU:
                 {
                     jit->push(jit->rcx);
 
-                    jit->mov(jit->cl, jit->byte[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
+                    jit->mov(jit->rcx, vreg(inst.i_rt));
+                    jit->mov(jit->rax, vreg(inst.i_rs));
                     jit->shl(jit->rax, jit->cl);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
 
                     jit->pop(jit->rcx);
                     break;
@@ -1599,152 +3612,224 @@ vm::VirtualMachine::functionJIT(VMFunction *vm_func)
                 {
                     jit->push(jit->rcx);
 
-                    jit->mov(jit->cl, jit->byte[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
+                    jit->mov(jit->rcx, vreg(inst.i_rt));
+                    jit->mov(jit->rax, vreg(inst.i_rs));
                     jit->sar(jit->rax, jit->cl);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
 
                     jit->pop(jit->rcx);
                     break;
                 }
+            case I_SHRI:
+                {
+                    auto reg = operand(inst.i_rd, inst.i_rs, inst.i_rs);
+                    jit->sar(reg, inst.i_simm);
+                    result(inst.i_rd, reg);
+                    break;
+                }
             case I_SHRU:
                 {
                     jit->push(jit->rcx);
 
-                    jit->mov(jit->cl, jit->byte[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
+                    jit->mov(jit->rcx, vreg(inst.i_rt));
+                    jit->mov(jit->rax, vreg(inst.i_rs));
                     jit->shr(jit->rax, jit->cl);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    jit->mov(vreg(inst.i_rd), jit->rax);
 
                     jit->pop(jit->rcx);
                     break;
                 }
+            case I_SHRUI:
+                {
+                    auto reg = operand(inst.i_rd, inst.i_rs, inst.i_rs);
+                    jit->shr(reg, inst.i_simm);
+                    result(inst.i_rd, reg);
+                    break;
+                }
             case I_SLE:
                 {
                     jit->mov(jit->r9, 1);
                     jit->xor(jit->r10, jit->r10);
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->cmp(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, vreg(inst.i_rt));
                     jit->cmovle(jit->r10, jit->r9);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->r10);
+                    jit->mov(vreg(inst.i_rd), jit->r10);
                     break;
                 }
             case I_SLEU:
                 {
                     jit->mov(jit->r9, 1);
                     jit->xor(jit->r10, jit->r10);
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->cmp(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, vreg(inst.i_rt));
                     jit->cmovbe(jit->r10, jit->r9);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->r10);
+                    jit->mov(vreg(inst.i_rd), jit->r10);
                     break;
                 }
             case I_SLT:
                 {
                     jit->mov(jit->r9, 1);
                     jit->xor(jit->r10, jit->r10);
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->cmp(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, vreg(inst.i_rt));
+                    jit->cmovl(jit->r10, jit->r9);
+                    jit->mov(vreg(inst.i_rd), jit->r10);
+                    break;
+                }
+            case I_SLTI:
+                {
+                    jit->mov(jit->r9, 1);
+                    jit->xor(jit->r10, jit->r10);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, inst.i_simm);
                     jit->cmovl(jit->r10, jit->r9);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->r10);
+                    jit->mov(vreg(inst.i_rd), jit->r10);
+                    break;
+                }
+            case I_SLTIU:
+                {
+                    jit->mov(jit->r9, 1);
+                    jit->xor(jit->r10, jit->r10);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, inst.i_simm);
+                    jit->cmovb(jit->r10, jit->r9);
+                    jit->mov(vreg(inst.i_rd), jit->r10);
                     break;
                 }
             case I_SLTU:
                 {
                     jit->mov(jit->r9, 1);
                     jit->xor(jit->r10, jit->r10);
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->cmp(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
+                    jit->mov(jit->rax, vreg(inst.i_rs));
+                    jit->cmp(jit->rax, vreg(inst.i_rt));
                     jit->cmovb(jit->r10, jit->r9);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->r10);
+                    jit->mov(vreg(inst.i_rd), jit->r10);
                     break;
                 }
             case I_STORE8:
                 {
-                    jit->mov(jit->ah, jit->byte[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->r9, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->byte[jit->r9], jit->ah);
+                    jit->mov(jit->rax, vreg(inst.i_rd));
+                    jit->mov(jit->r9, vreg(inst.i_rs));
+                    jit->mov(jit->byte[jit->r9 + inst.i_simm], jit->al);
                     break;
                 }
             case I_STORE8U:
                 {
-                    jit->mov(jit->ah, jit->byte[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->r9, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->byte[jit->r9], jit->ah);
+                    jit->mov(jit->rax, vreg(inst.i_rd));
+                    jit->mov(jit->r9, vreg(inst.i_rs));
+                    jit->mov(jit->byte[jit->r9 + inst.i_simm], jit->al);
                     break;
                 }
             case I_STORE16:
                 {
-                    jit->mov(jit->ax, jit->word[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->r9, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->word[jit->r9], jit->ax);
+                    jit->mov(jit->rax, vreg(inst.i_rd));
+                    jit->mov(jit->r9, vreg(inst.i_rs));
+                    jit->mov(jit->word[jit->r9 + inst.i_simm], jit->ax);
                     break;
                 }
             case I_STORE16U:
                 {
-                    jit->mov(jit->ax, jit->word[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->r9, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->word[jit->r9], jit->ax);
+                    jit->mov(jit->rax, vreg(inst.i_rd));
+                    jit->mov(jit->r9, vreg(inst.i_rs));
+                    jit->mov(jit->word[jit->r9 + inst.i_simm], jit->ax);
                     break;
                 }
             case I_STORE32:
                 {
-                    jit->mov(jit->eax, jit->dword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->r9, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->dword[jit->r9], jit->eax);
+                    jit->mov(jit->rax, vreg(inst.i_rd));
+                    jit->mov(jit->r9, vreg(inst.i_rs));
+                    jit->mov(jit->dword[jit->r9 + inst.i_simm], jit->eax);
                     break;
                 }
             case I_STORE32U:
                 {
-                    jit->mov(jit->eax, jit->dword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->r9, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->dword[jit->r9], jit->eax);
+                    jit->mov(jit->rax, vreg(inst.i_rd));
+                    jit->mov(jit->r9, vreg(inst.i_rs));
+                    jit->mov(jit->dword[jit->r9 + inst.i_simm], jit->eax);
                     break;
                 }
             case I_STORE64:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->r9, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->r9], jit->rax);
+                    jit->mov(jit->rax, vreg(inst.i_rd));
+                    jit->mov(jit->r9, vreg(inst.i_rs));
+                    jit->mov(jit->qword[jit->r9 + inst.i_simm], jit->rax);
                     break;
                 }
             case I_STORE64U:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->r9, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->r9], jit->rax);
+                    jit->mov(jit->rax, vreg(inst.i_rd));
+                    jit->mov(jit->r9, vreg(inst.i_rs));
+                    jit->mov(jit->qword[jit->r9 + inst.i_simm], jit->rax);
                     break;
                 }
             case I_SUB:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
+                    if (!inst.i_shift) {
+                        auto reg = operand(inst.i_rd, inst.i_rs, inst.i_rt);
+                        jit->sub(reg, vreg(inst.i_rt));
+                        result(inst.i_rd, reg);
+                        break;
+                    }
+                    jit->mov(jit->rax, vreg(inst.i_rt));
                     if (inst.i_shift) {
                         jit->sal(jit->rax, inst.i_shift);
                     }
-                    jit->mov(jit->r9, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
+                    jit->mov(jit->r9, vreg(inst.i_rs));
                     jit->sub(jit->r9, jit->rax);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->r9);
+                    jit->mov(vreg(inst.i_rd), jit->r9);
                     break;
                 }
             case I_XOR:
                 {
-                    jit->mov(jit->rax, jit->qword[jit->rsi + inst.i_rs * CYAN_PRODUCT_BYTES]);
-                    jit->xor(jit->rax, jit->qword[jit->rsi + inst.i_rt * CYAN_PRODUCT_BYTES]);
-                    jit->mov(jit->qword[jit->rsi + inst.i_rd * CYAN_PRODUCT_BYTES], jit->rax);
+                    auto reg = operand(inst.i_rd, inst.i_rs, inst.i_rt);
+                    jit->xor(reg, vreg(inst.i_rt));
+                    result(inst.i_rd, reg);
+                    break;
+                }
+            case I_XORI:
+                {
+                    auto reg = operand(inst.i_rd, inst.i_rs, inst.i_rs);
+                    jit->xor(reg, inst.i_simm);
+                    result(inst.i_rd, reg);
                     break;
                 }
             default:
                 assert(false);
         }
     }
+
+    // entries from interpreted loops, loading the registers live at the label
+    for (auto label : entry_labels) {
+        osr_offsets.emplace(label, jit->getSize());
+        enter(2 * label);
+        jit->jmp(std::to_string(label), jit->T_NEAR);
+    }
+
+    // rdi still holds the JIT state, realign the stack for the call
+    jit->L("stack_overflow");
+    jit->sub(jit->rsp, 8);
+    jit->mov(jit->rdi, jit->qword[jit->rdi + CONTEXT_OFFSET]);
+    jit->mov(jit->rsi, reinterpret_cast<uintptr_t>(vm_func));
+    call_native(reinterpret_cast<uintptr_t>(Context::jitStackOverflow));
+
+    jit->L("native_stack_overflow");
+    jit->sub(jit->rsp, 8);
+    jit->mov(jit->rdi, jit->qword[jit->rdi + CONTEXT_OFFSET]);
+    jit->mov(jit->rsi, reinterpret_cast<uintptr_t>(vm_func));
+    call_native(reinterpret_cast<uintptr_t>(Context::nativeStackOverflow));
     jit->ready();
+
+    for (auto &offset : osr_offsets) {
+        vm_func->osr_entries.emplace(offset.first, reinterpret_cast<JITFunction*>(jit->getCode() + offset.second));
+    }
+    vm_func->jit_code.store(jit->getCode<JITFunction*>(), std::memory_order_release);
 }
 
-std::unique_ptr<vm::VirtualMachine::Generate>
-vm::VirtualMachine::GenerateFactory(IR *ir)
+std::unique_ptr<vm::Program::Generate>
+vm::Program::GenerateFactory(IR *ir)
 {
     return std::unique_ptr<Generate>(new Generate(
-            new VirtualMachine(),
+            new Program(),
             ir
         ));
 }
@@ -1,10 +1,15 @@
 #ifndef _CYAN_VM_HPP_
 #define _CYAN_VM_HPP_
 
-#include <array>
+#include <atomic>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <type_traits>
 #include <vector>
-#include <stack>
 #include <memory>
 
 #include "cyan.hpp"
@@ -15,24 +20,31 @@
 
 #define CYAN_USE_COMPUTED_GOTO  1
 
+// 8-byte instructions, wide immediates go to the per-function constant pool
+#ifndef CYAN_COMPACT_INSTRUCTION
+#define CYAN_COMPACT_INSTRUCTION    0
+#endif
+
 namespace cyan {
 
 namespace vm {
 
-#if __CYAN_64__
+#if __CYAN_64__ && !CYAN_COMPACT_INSTRUCTION
 using OperatorT     = uint16_t;
 using ShiftT        = uint16_t;
 using RegisterT     = uint32_t;
+using SignedRegisterT   = int32_t;
 using ImmediateT    = uint64_t;
+using SignedImmediateT  = int64_t;
 #else
 using OperatorT     = uint8_t;
 using ShiftT        = uint8_t;
 using RegisterT     = uint16_t;
+using SignedRegisterT   = int16_t;
 using ImmediateT    = uint32_t;
+using SignedImmediateT  = int32_t;
 #endif
 
-static_assert(sizeof(ImmediateT) == sizeof(uintptr_t), "ImmdiateT should be large enough");
-
 enum InstOperator
 {
     I_UNKNOWN = 0,
@@ -42,13 +54,22 @@ enum InstOperator
     I_BNR,
     I_GLOB,
     I_JUMP,
+    I_LC,
     I_LI,
 
     InstOperator_ImmediateInst = I_LI,
 
     I_ADD,
+    I_ADDI,
     I_ALLOC,
     I_AND,
+    I_ANDI,
+    I_BEQ,
+    I_BLE,
+    I_BLEU,
+    I_BLT,
+    I_BLTU,
+    I_BNE,
     I_CALL,
     I_DELETE,
     I_DIV,
@@ -69,17 +90,22 @@ enum InstOperator
     I_NEW,
     I_NOR,
     I_OR,
-    I_POP,
-    I_PUSH,
+    I_ORI,
     I_RET,
     I_SEQ,
+    I_SEQI,
     I_SHL,
+    I_SHLI,
     I_SHLU,
     I_SHR,
+    I_SHRI,
     I_SHRU,
+    I_SHRUI,
     I_SLE,
     I_SLEU,
     I_SLT,
+    I_SLTI,
+    I_SLTIU,
     I_SLTU,
     I_STORE8,
     I_STORE8U,
@@ -91,6 +117,7 @@ enum InstOperator
     I_STORE64U,
     I_SUB,
     I_XOR,
+    I_XORI,
 
     InstOperator_NR
 };
@@ -106,6 +133,10 @@ struct Instruction
             RegisterT   _rs;
             RegisterT   _rt;
         } _regs;
+        struct {
+            RegisterT       _rs;
+            SignedRegisterT _simm;
+        } _regs_imm;
     } _info;
 
     Instruction(OperatorT op, ShiftT shift, RegisterT rd, ImmediateT imm)
@@ -123,48 +154,261 @@ struct Instruction
 #define i_imm   _info._imm
 #define i_rt    _info._regs._rt
 #define i_rs    _info._regs._rs
+#define i_simm  _info._regs_imm._simm  // immediate forms and load/store displacement
+#define i_target    i_rd    // compare-and-branch keeps its target in rd
 
 static_assert(sizeof(Instruction) == 2 * sizeof(ImmediateT), "Instruction should be 2 in sizeof ImmediateT");
 
+#if CYAN_COMPACT_INSTRUCTION
+
+/**
+ * Compact instruction as the interpreter runs it, dispatched by opcode with branch targets as indices
+ */
+struct ThreadedInstruction : public Instruction
+{
+    explicit ThreadedInstruction(const Instruction &inst)
+        : Instruction(inst)
+    { }
+};
+
+static_assert(sizeof(ThreadedInstruction) == sizeof(Instruction), "compact threaded code should stay 8 bytes");
+
+#else
+
+/**
+ * Instruction with its handler and branch target resolved, built at load
+ */
+struct ThreadedInstruction : public Instruction
+{
+    const void *handler = nullptr;
+    const ThreadedInstruction *target = nullptr;
+
+    explicit ThreadedInstruction(const Instruction &inst)
+        : Instruction(inst)
+    { }
+};
+
+#endif
+
 using Slot = uintptr_t;
 using SignedSlot = intptr_t;
 using GlobalSegment = std::vector<Slot>;
 
-class VirtualMachine;
+/**
+ * Conversion of host values to and from slots, for integers, enums and pointers
+ */
+template <typename T>
+struct SlotCast
+{
+    static_assert(std::is_integral<T>::value || std::is_enum<T>::value, "only integers and pointers fit in a Slot");
+
+    static inline Slot
+    to(T value)
+    { return static_cast<Slot>(value); }
+
+    static inline T
+    from(Slot value)
+    { return static_cast<T>(value); }
+};
+
+template <typename T>
+struct SlotCast<T *>
+{
+    static inline Slot
+    to(T *value)
+    { return reinterpret_cast<Slot>(value); }
+
+    static inline T *
+    from(Slot value)
+    { return reinterpret_cast<T *>(value); }
+};
+
+template <>
+struct SlotCast<void>
+{
+    static inline void
+    from(Slot)
+    { }
+};
+
+template <size_t ...I>
+struct IndexList
+{ };
+
+template <size_t N, size_t ...I>
+struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...>
+{ };
+
+template <size_t ...I>
+struct MakeIndexList<0, I...>
+{ using type = IndexList<I...>; };
+
+template <typename ...T>
+struct AllSlotSized : std::true_type
+{ };
+
+template <typename T, typename ...Rest>
+struct AllSlotSized<T, Rest...>
+    : std::integral_constant<bool, sizeof(T) == sizeof(Slot) && AllSlotSized<Rest...>::value>
+{ };
+
+class Program;
+class Context;
+struct JITState;
 class MovInst;
 
-using JITFunction = Slot(VirtualMachine *, Slot *, char *, Slot *);
+using JITFunction = Slot(JITState *, Slot *, char *, Slot *, char *);
 
 struct Function
 {
+    enum Kind
+    {
+        K_VM,
+        K_LIB
+    };
+
+    const Kind kind;
+
+    Function(Kind kind)
+        : kind(kind)
+    { }
+
     virtual ~Function() = default;
 };
 
 struct VMFunction : Function
 {
+    /**
+     * Instructions to run, either inst_list or code mapped in from an image
+     */
+    struct CodeView
+    {
+        const Instruction *_begin;
+        const Instruction *_end;
+
+        inline const Instruction *
+        begin() const
+        { return _begin; }
+
+        inline const Instruction *
+        end() const
+        { return _end; }
+
+        inline size_t
+        size() const
+        { return _end - _begin; }
+    };
+
     std::vector<Instruction> inst_list;
+    std::vector<ThreadedInstruction> threaded_list;
+    std::vector<Slot> constant_pool;
     size_t register_nr = 1;
+    size_t argument_nr = 0;
     std::string name;
+    const Instruction *mapped_code = nullptr;
+    size_t mapped_code_size = 0;
+    size_t index = 0;           // among the VM functions of its Program
+    std::atomic<JITFunction *> jit_code{nullptr};   // set once compiled, by any Context
+    std::map<size_t, JITFunction *> osr_entries;    // branch targets, set before jit_code
 
-    VMFunction(std::string name)
-        : name(name)
+    VMFunction(std::string name, size_t index)
+        : Function(K_VM), name(name), index(index)
     { }
+
+    inline CodeView
+    code() const
+    {
+        if (mapped_code) {
+            return CodeView{mapped_code, mapped_code + mapped_code_size};
+        }
+        return CodeView{inst_list.data(), inst_list.data() + inst_list.size()};
+    }
 };
 
+/**
+ * Native function called from VM code, through its thunk or directly from the JIT
+ */
 struct LibFunction : Function
 {
-    virtual Slot call(const Slot *argument) = 0;
+    using Thunk = Slot(void *native, const Slot *arguments);
+
+    constexpr static size_t DIRECT_ARGUMENT_NR = 6;     // passed in registers by SysV
+
+    Thunk *const thunk;
+    void *const native;
+    const size_t argument_nr;
+    const bool direct;          // arguments and return value are whole slots
+    const bool returns_void;    // leaves rax undefined, VM code reads 0 as the thunk returns
+
+    LibFunction(Thunk *thunk, void *native, size_t argument_nr, bool direct, bool returns_void = false)
+        : Function(K_LIB), thunk(thunk), native(native), argument_nr(argument_nr), direct(direct),
+          returns_void(returns_void)
+    { }
+
+    inline Slot
+    call(const Slot *arguments) const
+    { return thunk(native, arguments); }
 };
 
+/**
+ * LibFunction generated for a plain C++ function taking and returning integers or pointers
+ */
+template <typename Ret, typename ...Args>
+struct NativeFunction : LibFunction
+{
+    using Native = Ret(Args...);
+
+    explicit NativeFunction(Native *native)
+        : LibFunction(
+              &invoke,
+              reinterpret_cast<void *>(native),
+              sizeof...(Args),
+              sizeof...(Args) <= DIRECT_ARGUMENT_NR &&
+              AllSlotSized<typename std::conditional<std::is_void<Ret>::value, Slot, Ret>::type, Args...>::value,
+              std::is_void<Ret>::value
+          )
+    { }
+
+private:
+    static Slot
+    invoke(void *native, const Slot *arguments)
+    {
+        return invokeWith(
+            reinterpret_cast<Native *>(native),
+            arguments,
+            typename MakeIndexList<sizeof...(Args)>::type(),
+            std::is_void<Ret>()
+        );
+    }
+
+    template <size_t ...I>
+    static inline Slot
+    invokeWith(Native *native, const Slot *arguments, IndexList<I...>, std::false_type)
+    { return SlotCast<Ret>::to(native(SlotCast<Args>::from(arguments[I])...)); }
+
+    template <size_t ...I>
+    static inline Slot
+    invokeWith(Native *native, const Slot *arguments, IndexList<I...>, std::true_type)
+    {
+        native(SlotCast<Args>::from(arguments[I])...);
+        return 0;
+    }
+};
+
+template <typename Ret, typename ...Args>
+inline LibFunction *
+bindNative(Ret (*native)(Args...))
+{ return new NativeFunction<Ret, Args...>(native); }
+
 struct Frame
 {
     VMFunction *func;
-    std::vector<Slot> regs;
+    Slot *regs;
     size_t frame_pointer;
-    const Instruction *pc;
+    const ThreadedInstruction *pc;
 
-    Frame(VMFunction *func, size_t frame_pointer)
-        : func(func), regs(func->register_nr, 0), frame_pointer(frame_pointer), pc(func->inst_list.data())
+    Frame(VMFunction *func, Slot *regs, size_t frame_pointer)
+        : func(func), regs(regs), frame_pointer(frame_pointer), pc(func->threaded_list.data())
     { }
 
     inline Slot &
@@ -172,51 +416,364 @@ struct Frame
     { return regs[index]; }
 };
 
-Slot call_func(VirtualMachine *vm, Slot *arguments, Function *function);
+/**
+ * Register windows of all active frames, chunks never move while in use
+ *
+ * A callee window starts at the outgoing area at the end of its caller's
+ * window, so arguments written there become the callee's registers 1..n.
+ */
+class RegisterStack
+{
+public:
+    constexpr static size_t CHUNK_SLOTS = 1024 * 64;    // 512K per chunk
+    constexpr static size_t MAX_CHUNKS = 64;            // deeper recursion overflows
+
+private:
+    std::vector<std::pair<std::unique_ptr<Slot[]>, size_t> > chunks;
+    size_t chunk_index = 0;
+    Slot *chunk_base;
+    Slot *&limit;       // kept in the JITState, compiled calls check it themselves
+
+    Slot *enterSlow(Slot *window, size_t slots, size_t arguments);
+    void leaveSlow();
+
+public:
+    RegisterStack(Slot *&limit);
+    RegisterStack(const RegisterStack &) = delete;
+    RegisterStack &operator = (const RegisterStack &) = delete;
+
+    inline Slot *
+    bottom() const
+    { return chunks.front().first.get(); }
+
+    // nullptr once MAX_CHUNKS are in use
+    inline Slot *
+    enter(Slot *window, size_t slots, size_t arguments)
+    {
+        if (window + slots <= limit) {
+            return window;
+        }
+        return enterSlow(window, slots, arguments);
+    }
+
+    inline void
+    leave(Slot *window)
+    {
+        // only a window moved to a fresh chunk starts at its base
+        if (window == chunk_base) {
+            leaveSlow();
+        }
+    }
+};
+
+/**
+ * A mapping of VM memory failed, with the errno of mmap or mprotect
+ */
+struct MapFailedException : std::exception
+{
+    std::string _what;
+
+    MapFailedException(std::string what, int error)
+        : _what("cannot map " + what + ": " + std::strerror(error))
+    { }
+
+    const char *
+    what() const noexcept
+    { return _what.c_str(); }
+};
+
+/**
+ * Stack for ALLOC and spilled arguments, growing downwards
+ *
+ * Reserved with mmap so only touched pages are committed, the guard page
+ * below the usable area faults instead of corrupting memory. Throws
+ * MapFailedException when either can't be set up.
+ */
+class GuardedStack
+{
+    char *reservation;
+    size_t guard_size;
+    size_t usable_size;
+
+public:
+    GuardedStack(size_t size);
+    GuardedStack(const GuardedStack &) = delete;
+    GuardedStack &operator = (const GuardedStack &) = delete;
+    ~GuardedStack();
 
-class VirtualMachine
+    inline char *
+    data() const
+    { return reservation + guard_size; }
+
+    inline size_t
+    size() const
+    { return usable_size; }
+};
+
+/**
+ * Objects of NEW, small ones carved from chunks and recycled by size class
+ *
+ * A slot before each object holds its class, or the next free block once
+ * deleted. Only one Context uses an allocator, so nothing is locked. JIT
+ * code pops free lists and bumps the chunk itself, see Program::functionJIT.
+ */
+class ObjectAllocator
 {
 public:
-    constexpr static size_t STACK_SIZE = 1024 * 512;    // 512K stack
+    constexpr static size_t CLASS_NR = 33;     // (size + 7) / 8, up to 256 bytes
+    constexpr static size_t MAX_SMALL_SIZE = (CLASS_NR - 1) * sizeof(Slot);
+    constexpr static Slot LARGE_CLASS = CLASS_NR;
+    constexpr static size_t CHUNK_SIZE = 256 * 1024;
+
+    struct Stats
+    {
+        size_t allocations = 0;
+        size_t frees = 0;
+        size_t bytes = 0;           // requested by NEW
+        size_t live_objects = 0;
+        size_t chunks = 0;
+    };
+
+    // all public, the allocator stays standard layout for JIT code
+    Slot *free_lists[CLASS_NR];
+    char *bump = nullptr;
+    char *bump_limit = nullptr;
+    Stats stats;
+    char *chunk_list = nullptr;     // newest chunk, each links to the previous one in its first slot
 
 private:
-    GlobalSegment globals;
+    void *allocateSlow(size_t size);
+
+public:
+    ObjectAllocator();
+    ObjectAllocator(const ObjectAllocator &) = delete;
+    ObjectAllocator &operator = (const ObjectAllocator &) = delete;
+    ~ObjectAllocator();
+
+    static inline size_t
+    sizeClass(size_t size)
+    { return (size + sizeof(Slot) - 1) / sizeof(Slot); }
+
+    static inline size_t
+    blockSize(size_t size_class)
+    { return (size_class + 1) * sizeof(Slot); }
+
+    inline void *
+    allocate(size_t size)
+    {
+        if (size <= MAX_SMALL_SIZE) {
+            auto size_class = sizeClass(size);
+            auto block = free_lists[size_class];
+            if (block) {
+                free_lists[size_class] = reinterpret_cast<Slot *>(*block);
+            }
+            else if (bump + blockSize(size_class) <= bump_limit) {
+                block = reinterpret_cast<Slot *>(bump);
+                bump += blockSize(size_class);
+            }
+            else {
+                return allocateSlow(size);
+            }
+
+            *block = size_class;
+            ++stats.allocations;
+            stats.bytes += size;
+            ++stats.live_objects;
+            return block + 1;
+        }
+        return allocateSlow(size);
+    }
+
+    inline void
+    release(void *object)
+    {
+        auto block = static_cast<Slot *>(object) - 1;
+        ++stats.frees;
+        --stats.live_objects;
+
+        if (*block == LARGE_CLASS) {
+            std::free(block);
+            return;
+        }
+        auto size_class = *block;
+        *block = reinterpret_cast<Slot>(free_lists[size_class]);
+        free_lists[size_class] = block;
+    }
+};
+
+/**
+ * Part of a Context used by compiled code, which gets its address in RDI
+ *
+ * Standard layout, so JIT code reaches the fields by offsetof.
+ */
+struct JITState
+{
+    Context *context;
+    ObjectAllocator allocator;
+    Slot *register_limit;           // end of the current register stack chunk
+    Slot *host_window = nullptr;    // above the arguments of the innermost library call
+    char *native_stack_limit = nullptr;     // compiled calls overflow below it, set for the running thread
+};
+
+Slot call_func(Context *context, Slot *window, Function *function, char *stack_top, size_t arguments);
+
+template <typename T> class Handle;
+
+/**
+ * Compiled code shared by every Context running it
+ *
+ * Immutable once built, except that the interpreter threading and the JIT
+ * compilation are each done once, by the first Context needing them.
+ */
+class Program
+{
+public:
+    constexpr static uint32_t IMAGE_VERSION = 5;
+
+    /**
+     * Slot of a snapshot fixed up in each Context, value is added to the base
+     */
+    struct Relocation
+    {
+        enum Base
+        {
+            R_ABSOLUTE,
+            R_GLOBALS,
+            R_HEAP
+        };
+
+        bool in_heap;
+        size_t offset;
+        Base base;
+        Slot value;
+    };
+
+private:
+    GlobalSegment globals;      // initial values of every Context
     std::vector<char> string_pool;
-    std::stack<std::unique_ptr<Frame> > frame_stack;
-    std::array<char, STACK_SIZE> stack;
-    size_t stack_pointer = STACK_SIZE;
     std::map<std::string, std::unique_ptr<Function> > functions;
-    std::map<Function *, std::unique_ptr<Xbyak::CodeGenerator> > jit_results;
+    mutable std::map<Function *, std::unique_ptr<Xbyak::CodeGenerator> > jit_results;
+    char *image = nullptr;      // mapping of a loaded image
+    size_t image_size = 0;
+    int image_fd = -1;          // kept open to map the snapshot heap into each Context
+    size_t heap_offset = 0;
+    size_t heap_size = 0;
+    std::vector<Relocation> relocations;
+    std::vector<bool> global_references;        // whether a global may hold an address, by its IR type
+    std::vector<std::vector<bool> > layouts;    // slots of a NEW object that may hold an address, by NEW's rt
+    bool initialized = false;   // a snapshot taken after _init_
+    size_t vm_function_nr = 0;
+    size_t function_slot_base = 0;  // globals holding every function, in the order of functions
+    size_t function_slot_nr = 0;
+    mutable std::once_flag threaded;
+    mutable std::once_flag compiled;
+    mutable std::mutex jit_mutex;
 
-    Slot run();
-    void functionJIT(VMFunction *vm_func);
+    Program() = default;
+
+    void threadCode(void *const *dispatch_table) const;
+    void compileJIT() const;
+    void compileFunction(VMFunction *vm_func) const;
+    void functionJIT(VMFunction *vm_func) const;
+    std::map<size_t, const Function *> findCallees(const VMFunction *vm_func) const;
+
+    /**
+     * VM registers kept in host registers by compiled code, each for the whole function
+     */
+    struct RegisterMap
+    {
+        constexpr static int IN_WINDOW = -1;
+
+        std::vector<int> host;                  // index of the host register
+        std::vector<size_t> interval_start;     // a read at 2 * i and a write at 2 * i + 1
+        std::vector<size_t> interval_end;
+
+        inline bool
+        liveAt(size_t reg, size_t position) const
+        { return interval_start[reg] <= position && position <= interval_end[reg]; }
+    };
+
+    RegisterMap mapRegisters(const VMFunction *vm_func, size_t host_nr) const;
 
-    VirtualMachine() = default;
 public:
-    ~VirtualMachine() = default;
+    Program(const Program &) = delete;
+    Program &operator = (const Program &) = delete;
+    ~Program();
 
     struct Generate : public ::cyan::CodeGen
     {
     private:
-        std::unique_ptr<VirtualMachine> _product;
+        std::unique_ptr<Program> _product;
         VMFunction *current_func;
         std::map<std::string, size_t> global_map;
+        std::map<Type *, RegisterT> layout_map;
         std::map<BasicBlock *, size_t> block_map;
         std::map<::cyan::Instruction *, RegisterT> value_map;
+        std::map<::cyan::Instruction *, size_t> use_count;
+        std::set<::cyan::Instruction *> fused_conditions;
+        std::set<::cyan::Instruction *> folded_values;
+        std::map<::cyan::Instruction *, std::pair<::cyan::Instruction *, intptr_t> > folded_operands;
+        std::vector<std::pair<size_t, BasicBlock *> > target_fixups;
+        std::map<intptr_t, RegisterT> spilled_arguments;
+        RegisterT scratch_reg;
+        RegisterT outgoing_base;
         std::list<std::unique_ptr<::cyan::Instruction> > phi_ref;
 
-        Generate(VirtualMachine *product, IR *ir)
+        Generate(Program *product, IR *ir)
             : CodeGen(ir), _product(product)
         { }
 
         void generateFunc(::cyan::Function *func);
+        void countUses(::cyan::Function *func);
+        void findArguments(::cyan::Function *func);
+        void findFusedConditions(::cyan::Function *func);
+        void findFoldedOperands(::cyan::Function *func);
+        ::cyan::Instruction *foldImmediate(BinaryInst *inst);
+        bool genImmediateForm(::cyan::Instruction *inst, OperatorT op);
+
+        static bool getImmediate(::cyan::Instruction *inst, intptr_t &value);
+        static void normalizeAdd(AddInst *inst);
+        static ShiftT scaleShift(Type *type);
+        static bool holdsReference(Type *type);
+        RegisterT layoutOf(Type *type);
+
+        static inline bool
+        fitsImmediate(intptr_t value)
+        {
+            return value >= std::numeric_limits<SignedRegisterT>::min() &&
+                   value <= std::numeric_limits<SignedRegisterT>::max();
+        }
+        void genBranch(::cyan::Instruction *condition, bool negative, BasicBlock *target);
+        void genLoadImmediate(RegisterT rd, intptr_t value);
+
+        static void foreachRegister(Instruction &inst, std::function<void(RegisterT &, bool)> callback);
+        static bool isBranch(const Instruction &inst);
+        static size_t branchTarget(const Instruction &inst);
+        static void setBranchTarget(Instruction &inst, size_t target);
+        static bool invertBranch(Instruction &inst);
+        static void removeInstructions(std::vector<Instruction> &code, const std::vector<bool> &removed);
+        static void computeLiveness(
+            const std::vector<Instruction> &code,
+            size_t register_nr,
+            std::vector<size_t> &block_start,
+            std::vector<std::vector<bool> > &live_in,
+            std::vector<std::vector<bool> > &live_out
+        );
     public:
+        // values with disjoint live ranges share a register, returns where the outgoing window moved
+        static RegisterT allocateRegisters(VMFunction *func, size_t argument_nr, RegisterT outgoing_base, size_t outgoing_nr);
+
         virtual std::ostream &generate(std::ostream &os);
         void generate();
+        void optimize();
+
+        // the peephole pass optimize runs on every VM function
+        static void optimizeFunc(VMFunction *func);
+
         inst_foreach(define_gen);
         void gen(MovInst *);
 
-        inline std::unique_ptr<VirtualMachine>
+        inline std::unique_ptr<Program>
         release()
         { return std::move(_product); }
 
@@ -224,16 +781,269 @@ public:
         registerLibFunction(std::string name, LibFunction *func)
         { _product->functions.emplace(name, std::unique_ptr<Function>(func)); }
 
-        friend class VirtualMachine;
+        friend class Program;
     };
 
+    struct Load
+    {
+    private:
+        std::unique_ptr<Program> _product;
+
+        Load(Program *product)
+            : _product(product)
+        { }
+
+    public:
+        bool load(const char *path);
+
+        inline std::unique_ptr<Program>
+        release()
+        { return std::move(_product); }
+
+        inline void
+        registerLibFunction(std::string name, LibFunction *func)
+        { _product->functions.emplace(name, std::unique_ptr<Function>(func)); }
+
+        friend class Program;
+    };
+
+    struct PrepareException : std::exception
+    {
+        std::string _what;
+
+        PrepareException(std::string message)
+            : _what(message)
+        { }
+
+        const char *
+        what() const noexcept
+        { return _what.c_str(); }
+    };
+
+    // with a context, its globals and heap after _init_ are saved as a snapshot
+    void saveImage(std::ostream &os, const Context *context = nullptr) const;
+
+    /**
+     * Resolve a VM function once, the handle can be called on any Context of this Program
+     */
+    template <typename T>
+    Handle<T> prepare(const std::string &name) const;
+
+    static std::unique_ptr<Generate> GenerateFactory(IR *ir);
+    static std::unique_ptr<Load> LoadFactory();
+    static bool isImage(const char *path);
+
+    // whether code mapped from an image stays within its function, registers and globals
+    static bool validateCode(const VMFunction *vm_func, size_t global_nr);
+
+    friend class Context;
+};
+
+/**
+ * Per-thread state of a running Program, Contexts of one Program share nothing mutable
+ */
+class Context
+{
+public:
+    constexpr static size_t STACK_SIZE = 1024 * 1024 * 8;  // 8M stack, committed as touched
+    constexpr static size_t INITIAL_FRAMES = 1024;
+    constexpr static uint32_t CALL_THRESHOLD = 1000;
+    constexpr static uint32_t BACK_EDGE_THRESHOLD = 10000;
+    constexpr static size_t NATIVE_STACK_RESERVE = 1024 * 256;     // left to natives below compiled frames
+
+    /**
+     * Reports an error that can't be thrown through compiled frames, the context aborts if it returns
+     */
+    typedef std::function<void(const std::exception &)> FatalHandler;
+
+private:
+    const Program *program;
+    GlobalSegment globals;
+    JITState jit_state;         // before register_stack, which keeps its limit here
+    RegisterStack register_stack;
+    std::vector<Frame> frames;
+    GuardedStack stack;
+    size_t stack_pointer;
+    char *heap_mapping = nullptr;   // snapshot heap, mapped privately from the image
+    size_t heap_mapping_size = 0;
+    char *heap = nullptr;
+    bool initialized;           // _init_ has run, or restored from a snapshot
+    bool tracking_heap = false;
+    std::map<Slot, std::pair<size_t, RegisterT> > heap_blocks;  // objects allocated while tracking, to size and layout
+    bool ready = false;
+    bool jit = false;
+    bool tiered = false;
+    uint32_t call_threshold = CALL_THRESHOLD;
+    uint32_t back_edge_threshold = BACK_EDGE_THRESHOLD;
+    std::vector<uint32_t> call_counts;      // per VM function, while tiered
+    std::vector<uint32_t> back_edge_counts;
+    size_t jit_depth = 0;       // compiled frames running, exceptions can't pass them
+    FatalHandler fatal_handler = defaultFatalHandler;
+    size_t native_stack_size = 0;   // of the thread that set up compiled code
+
+    Slot run();
+
+    inline Frame *
+    pushFrame(VMFunction *func, Slot *window, size_t arguments, size_t frame_pointer)
+    {
+        auto regs = register_stack.enter(window, func->register_nr, arguments);
+        if (!regs) {
+            registerStackOverflow(this, func);
+        }
+        regs[0] = 0;    // register 0 is never assigned, it reads as zero
+        frames.emplace_back(func, regs, frame_pointer);
+        return &frames.back();
+    }
+
+    inline void
+    popFrame()
+    {
+        register_stack.leave(frames.back().regs);
+        frames.pop_back();
+    }
+
+    inline void
+    countCall(VMFunction *func)
+    {
+        if (tiered && ++call_counts[func->index] == call_threshold) {
+            program->compileFunction(func);
+        }
+    }
+
+    // whether a frame of func looping here should move to its compiled code
+    inline bool
+    countBackEdge(VMFunction *func)
+    {
+        if (!tiered) {
+            return false;
+        }
+
+        auto count = ++back_edge_counts[func->index];
+        if (count == back_edge_threshold) {
+            program->compileFunction(func);
+        }
+        return count >= back_edge_threshold && func->jit_code.load(std::memory_order_acquire);
+    }
+
+    bool enterCompiled(Frame *frame, const ThreadedInstruction *target, Slot &ret_val);
+
+    Slot interpret(VMFunction *func, Slot *window, size_t arguments, char *stack_top);
+    void limitNativeStack();
+
+    [[noreturn]] static void stackOverflow(Context *context);
+    [[noreturn]] static void jitStackOverflow(Context *context, const VMFunction *func);
+    [[noreturn]] static void registerStackOverflow(Context *context, const VMFunction *func);
+    [[noreturn]] static void nativeStackOverflow(Context *context, const VMFunction *func);
+    [[noreturn]] void fatal(const std::exception &e);
+public:
+    /**
+     * Overflow of resource, the VM stack, the register stack or the native stack, limited to limit bytes
+     */
+    struct StackOverflowException : std::exception
+    {
+        std::string _what;
+
+        StackOverflowException(std::string resource, std::string function, size_t limit)
+            : _what(resource + " overflow in " + function + ", " + std::to_string(limit / 1024) + "K reserved")
+        { }
+
+        const char *
+        what() const noexcept
+        { return _what.c_str(); }
+    };
+
+    // program must outlive the context
+    Context(const Program *program, size_t stack_size = STACK_SIZE);
+    Context(const Context &) = delete;
+    Context &operator = (const Context &) = delete;
+    ~Context();
+
     Slot start();
     Slot startJIT();
+    Slot startTiered(uint32_t call_threshold = CALL_THRESHOLD, uint32_t back_edge_threshold = BACK_EDGE_THRESHOLD);
+    void initialize();
 
-    static std::unique_ptr<Generate> GenerateFactory(IR *ir);
-    friend Slot ::cyan::vm::call_func(VirtualMachine *, Slot *, Function *);
+    // get ready for calls from the host in either tier, running _init_ if needed
+    void setup();
+    void setupJIT();
+
+    /**
+     * Interpret functions until they get hot, compiling them on the count of
+     * calls or loop back-edges
+     */
+    void setupTiered(uint32_t call_threshold = CALL_THRESHOLD, uint32_t back_edge_threshold = BACK_EDGE_THRESHOLD);
+
+    /**
+     * Call a VM function with arguments already in slots, on the tier set up
+     */
+    Slot call(const VMFunction *function, const Slot *arguments, size_t argument_nr);
+
+    inline void
+    setFatalHandler(FatalHandler handler)
+    { fatal_handler = handler; }
+
+    static void defaultFatalHandler(const std::exception &e);
+
+    inline const ObjectAllocator::Stats &
+    allocatorStats() const
+    { return jit_state.allocator.stats; }
+
+    static void *newObject(Context *context, size_t size);
+    static void deleteObject(Context *context, void *object);
+
+    friend class Program;
+    friend Slot ::cyan::vm::call_func(Context *, Slot *, Function *, char *, size_t);
 };
 
+/**
+ * Typed call handle of a VM function, from Program::prepare
+ */
+template <typename Ret, typename ...Args>
+class Handle<Ret(Args...)>
+{
+public:
+    constexpr static size_t ARGUMENT_NR = sizeof...(Args);
+
+private:
+    const VMFunction *function;
+
+    Handle(const VMFunction *function)
+        : function(function)
+    { }
+
+public:
+    inline Ret
+    operator () (Context &context, Args ...args) const
+    {
+        const Slot arguments[sizeof...(Args) + 1] = { SlotCast<Args>::to(args)..., 0 };
+        return SlotCast<Ret>::from(context.call(function, arguments, sizeof...(Args)));
+    }
+
+    friend class Program;
+};
+
+template <typename T>
+Handle<T>
+Program::prepare(const std::string &name) const
+{
+    auto func_iter = functions.find(name);
+    if (func_iter == functions.end()) {
+        throw PrepareException("no function named " + name);
+    }
+    if (func_iter->second->kind != Function::K_VM) {
+        throw PrepareException(name + " is a library function");
+    }
+
+    auto vm_func = static_cast<const VMFunction *>(func_iter->second.get());
+    if (vm_func->argument_nr != Handle<T>::ARGUMENT_NR) {
+        throw PrepareException(
+            name + " takes " + std::to_string(vm_func->argument_nr) + " arguments, not " +
+            std::to_string(Handle<T>::ARGUMENT_NR)
+        );
+    }
+    return Handle<T>(vm_func);
+}
+
 }
 
 }
@@ -0,0 +1,551 @@
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vm.hpp"
+
+using namespace cyan;
+
+/**
+ * Image layout, every section 8-byte aligned:
+ *
+ *   ImageHeader
+ *   ImageFunction[function_nr]     in the order of Program::functions
+ *   ImageSlot[global_nr]           globals with their relocations, function_nr of them
+ *                                  from function_slot_base hold the functions in order
+ *   code and constant pools        per VM function, code is run in place
+ *   names                          function names, not terminated
+ *   string pool                    used in place by string globals
+ *   heap                           snapshot only, objects reachable from globals
+ *   ImageRelocation[relocation_nr] snapshot only, pointers inside the heap
+ *
+ * A snapshot is taken after _init_, each Context maps its heap privately.
+ */
+
+namespace {
+
+const char IMAGE_MAGIC[4] = {'C', 'Y', 'V', 'M'};
+
+struct ImageHeader
+{
+    enum Flags
+    {
+        F_INITIALIZED = 1
+    };
+
+    char magic[4];
+    uint32_t version;
+    uint32_t instruction_size;
+    uint32_t operator_nr;
+    uint64_t flags;
+    uint64_t function_nr;
+    uint64_t function_offset;
+    uint64_t global_nr;
+    uint64_t global_offset;
+    uint64_t function_slot_base;
+    uint64_t string_pool_size;
+    uint64_t string_pool_offset;
+    uint64_t heap_size;
+    uint64_t heap_offset;
+    uint64_t relocation_nr;
+    uint64_t relocation_offset;
+};
+
+struct ImageFunction
+{
+    uint64_t kind;
+    uint64_t name_offset;
+    uint64_t name_size;
+    uint64_t register_nr;
+    uint64_t argument_nr;
+    uint64_t code_offset;
+    uint64_t code_size;
+    uint64_t constant_offset;
+    uint64_t constant_nr;
+};
+
+struct ImageSlot
+{
+    enum Kind
+    {
+        S_DATA,
+        S_STRING,       // value is an offset into the string pool
+        S_FUNCTION,     // value is an index into the function table
+        S_GLOBAL,       // value is an offset into the globals
+        S_HEAP          // value is an offset into the heap
+    };
+
+    uint64_t kind;
+    uint64_t value;
+};
+
+struct ImageRelocation
+{
+    uint64_t offset;    // of the slot in the heap
+    ImageSlot slot;
+};
+
+inline size_t
+append(std::vector<char> &buffer, const void *data, size_t size)
+{
+    while (buffer.size() % 8) {
+        buffer.push_back('\0');
+    }
+
+    auto offset = buffer.size();
+    buffer.insert(buffer.end(), reinterpret_cast<const char *>(data), reinterpret_cast<const char *>(data) + size);
+    return offset;
+}
+
+}
+
+vm::Program::~Program()
+{
+    if (image) {
+        munmap(image, image_size);
+    }
+    if (image_fd >= 0) {
+        close(image_fd);
+    }
+}
+
+void
+vm::Context::deleteObject(Context *context, void *object)
+{
+    auto pointer = static_cast<char *>(object);
+    if (pointer >= context->heap && pointer < context->heap + context->program->heap_size) {
+        return;     // restored from a snapshot
+    }
+
+    if (!object) {
+        return;
+    }
+
+    if (context->tracking_heap) {
+        context->heap_blocks.erase(reinterpret_cast<Slot>(object));
+    }
+    context->jit_state.allocator.release(object);
+}
+
+/**
+ * Run _init_ in the interpreter, recording objects it allocates for Program::saveImage
+ */
+void
+vm::Context::initialize()
+{
+    assert(!initialized);
+
+    std::call_once(program->threaded, [this] () { run(); });  // no frame yet, threads the code
+
+    assert(program->functions.at("_init_")->kind == Function::K_VM);
+    auto init_func = static_cast<VMFunction*>(program->functions.at("_init_").get());
+
+    tracking_heap = true;
+    pushFrame(init_func, register_stack.bottom(), 0, stack_pointer);
+    run();
+    tracking_heap = false;
+
+    initialized = true;
+}
+
+void
+vm::Program::saveImage(std::ostream &os, const Context *context) const
+{
+    // the heap of a loaded snapshot is not tracked
+    assert(!initialized);
+    assert(!context || (context->program == this && context->initialized));
+
+    std::map<Slot, std::pair<size_t, RegisterT> > no_blocks;
+    auto &slots = context ? context->globals : globals;
+    auto &heap_blocks = context ? context->heap_blocks : no_blocks;
+    auto snapshot = context != nullptr;
+
+    const char *strings = string_pool.data();
+    size_t strings_size = string_pool.size();
+    if (image) {
+        auto loaded = reinterpret_cast<const ImageHeader *>(image);
+        strings = image + loaded->string_pool_offset;
+        strings_size = loaded->string_pool_size;
+    }
+
+    std::map<const Function *, uint64_t> function_index;
+    for (auto &func_pair : functions) {
+        auto index = function_index.size();
+        function_index.emplace(func_pair.second.get(), index);
+    }
+
+    // heap blocks reachable from globals to their offset in the heap section
+    std::map<Slot, size_t> heap_offsets;
+    std::vector<std::pair<Slot, std::pair<size_t, RegisterT> > > heap_worklist;
+    size_t heap_size = 0;
+
+    auto find_block = [&] (Slot value) {
+        auto block_iter = heap_blocks.upper_bound(value);
+        if (block_iter == heap_blocks.begin()) { return heap_blocks.end(); }
+        --block_iter;
+        return value < block_iter->first + block_iter->second.first ? block_iter : heap_blocks.end();
+    };
+
+    auto classify = [&] (Slot value) {
+        ImageSlot slot{ImageSlot::S_DATA, value};
+        auto pointer = reinterpret_cast<const char *>(value);
+        auto global_base = reinterpret_cast<Slot>(slots.data());
+        auto func_iter = function_index.find(reinterpret_cast<const Function *>(value));
+        auto block_iter = find_block(value);
+
+        if (pointer >= strings && pointer < strings + strings_size) {
+            slot.kind = ImageSlot::S_STRING;
+            slot.value = pointer - strings;
+        }
+        else if (func_iter != function_index.end()) {
+            slot.kind = ImageSlot::S_FUNCTION;
+            slot.value = func_iter->second;
+        }
+        else if (snapshot && value >= global_base && value < global_base + slots.size() * sizeof(Slot)) {
+            slot.kind = ImageSlot::S_GLOBAL;
+            slot.value = value - global_base;
+        }
+        else if (snapshot && block_iter != heap_blocks.end()) {
+            auto offset_iter = heap_offsets.find(block_iter->first);
+            if (offset_iter == heap_offsets.end()) {
+                offset_iter = heap_offsets.emplace(block_iter->first, heap_size).first;
+                heap_worklist.push_back(*block_iter);
+                heap_size += (block_iter->second.first + sizeof(Slot) - 1) / sizeof(Slot) * sizeof(Slot);
+            }
+            slot.kind = ImageSlot::S_HEAP;
+            slot.value = offset_iter->second + (value - block_iter->first);
+        }
+        return slot;
+    };
+
+    std::vector<char> buffer(sizeof(ImageHeader), '\0');
+    ImageHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.instruction_size = sizeof(Instruction);
+    header.operator_nr = InstOperator_NR;
+    header.flags = snapshot ? ImageHeader::F_INITIALIZED : 0;
+    header.function_nr = functions.size();
+    header.global_nr = slots.size();
+    header.function_slot_base = function_slot_base;
+    assert(function_slot_nr == functions.size());
+
+    std::vector<ImageFunction> function_table;
+    header.function_offset = append(buffer, nullptr, 0);
+    buffer.resize(buffer.size() + functions.size() * sizeof(ImageFunction));
+
+    // only a slot typed to hold an address is relocated, an integer equal to one is kept as data
+    header.global_offset = append(buffer, nullptr, 0);
+    for (size_t i = 0; i < slots.size(); ++i) {
+        ImageSlot slot{ImageSlot::S_DATA, slots[i]};
+        if (i >= global_references.size() || global_references[i]) {
+            slot = classify(slots[i]);
+        }
+        append(buffer, &slot, sizeof(slot));
+    }
+
+    for (auto &func_pair : functions) {
+        ImageFunction entry;
+        std::memset(&entry, 0, sizeof(entry));
+        entry.kind = func_pair.second->kind;
+
+        if (func_pair.second->kind == Function::K_VM) {
+            auto vm_func = static_cast<const VMFunction *>(func_pair.second.get());
+            auto code = vm_func->code();
+            entry.register_nr = vm_func->register_nr;
+            entry.argument_nr = vm_func->argument_nr;
+            entry.code_offset = append(buffer, code.begin(), code.size() * sizeof(Instruction));
+            entry.code_size = code.size();
+            entry.constant_offset = append(
+                buffer,
+                vm_func->constant_pool.data(),
+                vm_func->constant_pool.size() * sizeof(Slot)
+            );
+            entry.constant_nr = vm_func->constant_pool.size();
+        }
+        function_table.push_back(entry);
+    }
+
+    auto func_iter = functions.begin();
+    for (auto &entry : function_table) {
+        entry.name_offset = buffer.size();
+        entry.name_size = func_iter->first.size();
+        buffer.insert(buffer.end(), func_iter->first.begin(), func_iter->first.end());
+        ++func_iter;
+    }
+
+    header.string_pool_size = strings_size;
+    header.string_pool_offset = append(buffer, strings, strings_size);
+
+    // scanning a block may discover more blocks, they are laid out in discovery order
+    std::vector<ImageRelocation> relocations;
+    header.heap_offset = append(buffer, nullptr, 0);
+    for (size_t i = 0; i < heap_worklist.size(); ++i) {
+        auto block = heap_worklist[i];
+        auto block_size = block.second.first;
+        auto block_offset = append(buffer, reinterpret_cast<const void *>(block.first), block_size) -
+                            header.heap_offset;
+        assert(block_offset == heap_offsets.at(block.first));
+
+        // the layout repeats over array elements, code loaded from an image has none and is scanned whole
+        std::vector<bool> scan_all(1, true);
+        auto &layout = block.second.second < layouts.size() ? layouts[block.second.second] : scan_all;
+
+        for (size_t offset = 0; offset + sizeof(Slot) <= block_size; offset += sizeof(Slot)) {
+            if (!layout[offset / sizeof(Slot) % layout.size()]) {
+                continue;
+            }
+            auto slot = classify(*reinterpret_cast<const Slot *>(block.first + offset));
+            if (slot.kind != ImageSlot::S_DATA) {
+                relocations.push_back(ImageRelocation{block_offset + offset, slot});
+            }
+        }
+    }
+    header.heap_size = heap_size;
+    buffer.resize(header.heap_offset + heap_size);
+
+    header.relocation_nr = relocations.size();
+    header.relocation_offset = append(buffer, relocations.data(), relocations.size() * sizeof(ImageRelocation));
+
+    std::memcpy(buffer.data(), &header, sizeof(header));
+    if (function_table.size()) {
+        std::memcpy(
+            buffer.data() + header.function_offset,
+            function_table.data(),
+            function_table.size() * sizeof(ImageFunction)
+        );
+    }
+
+    os.write(buffer.data(), buffer.size());
+}
+
+bool
+vm::Program::isImage(const char *path)
+{
+    std::ifstream input(path, std::ios::binary);
+    char magic[sizeof(IMAGE_MAGIC)];
+
+    return input.read(magic, sizeof(magic)) && !std::memcmp(magic, IMAGE_MAGIC, sizeof(magic));
+}
+
+bool
+vm::Program::validateCode(const VMFunction *vm_func, size_t global_nr)
+{
+    auto code = vm_func->code();
+    auto register_nr = vm_func->register_nr;
+    if (!register_nr || register_nr - 1 > std::numeric_limits<RegisterT>::max()) {
+        return false;
+    }
+
+    // running off the end would read past the code
+    if (!code.size() || (code.end()[-1].i_op != I_JUMP && code.end()[-1].i_op != I_RET)) {
+        return false;
+    }
+
+    for (auto inst : code) {
+        if (inst.i_op == I_UNKNOWN || inst.i_op >= InstOperator_NR) {
+            return false;
+        }
+
+        bool valid = true;
+        Generate::foreachRegister(inst, [&](RegisterT &reg, bool) {
+            valid = valid && reg < register_nr;
+        });
+        if (Generate::isBranch(inst)) {
+            valid = valid && Generate::branchTarget(inst) < code.size();
+        }
+
+        switch (inst.i_op) {
+            case I_ARG:
+                valid = valid && inst.i_imm + 1 < register_nr;
+                break;
+            case I_CALL:
+                valid = valid && inst.i_rt + static_cast<size_t>(inst.i_shift) < register_nr;
+                break;
+            case I_GLOB:
+                valid = valid && inst.i_imm < global_nr;
+                break;
+            case I_LC:
+                valid = valid && inst.i_imm < vm_func->constant_pool.size();
+                break;
+            case I_ADD:
+            case I_SUB:
+                valid = valid && inst.i_shift < 64;
+                break;
+            case I_SHLI:
+            case I_SHRI:
+            case I_SHRUI:
+                valid = valid && inst.i_simm >= 0 && inst.i_simm < 64;
+                break;
+            default:
+                break;
+        }
+        if (!valid) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+vm::Program::Load::load(const char *path)
+{
+    assert(!_product->image);
+
+    auto fd = open(path, O_RDONLY);
+    if (fd < 0) { return false; }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0 || static_cast<size_t>(file_stat.st_size) < sizeof(ImageHeader)) {
+        close(fd);
+        return false;
+    }
+
+    // private writable mapping, string literals may be written by the program
+    auto mapping = mmap(nullptr, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    _product->image = static_cast<char *>(mapping);
+    _product->image_size = file_stat.st_size;
+    _product->image_fd = fd;
+
+    auto image = _product->image;
+    auto image_size = _product->image_size;
+    auto contains = [&] (uint64_t offset, uint64_t count, uint64_t size) {
+        return offset <= image_size &&
+               offset % 8 == 0 &&
+               count <= (image_size - offset) / size;
+    };
+
+    auto header = reinterpret_cast<const ImageHeader *>(image);
+    if (std::memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) ||
+        header->version != IMAGE_VERSION ||
+        header->instruction_size != sizeof(Instruction) ||
+        header->operator_nr != InstOperator_NR ||
+        !contains(header->function_offset, header->function_nr, sizeof(ImageFunction)) ||
+        !contains(header->global_offset, header->global_nr, sizeof(ImageSlot)) ||
+        header->function_slot_base > header->global_nr ||
+        header->function_nr > header->global_nr - header->function_slot_base ||
+        !contains(header->string_pool_offset, header->string_pool_size, 1) ||
+        !contains(header->heap_offset, header->heap_size, 1) ||
+        !contains(header->relocation_offset, header->relocation_nr, sizeof(ImageRelocation))) {
+        return false;
+    }
+
+    std::vector<Function *> function_table;
+    auto function_entries = reinterpret_cast<const ImageFunction *>(image + header->function_offset);
+    for (size_t i = 0; i < header->function_nr; ++i) {
+        auto &entry = function_entries[i];
+        if (entry.name_offset > image_size || entry.name_size > image_size - entry.name_offset) {
+            return false;
+        }
+        std::string name(image + entry.name_offset, entry.name_size);
+
+        if (entry.kind == Function::K_LIB) {
+            auto func_iter = _product->functions.find(name);
+            if (func_iter == _product->functions.end() || func_iter->second->kind != Function::K_LIB) {
+                return false;
+            }
+            function_table.push_back(func_iter->second.get());
+        }
+        else if (entry.kind == Function::K_VM) {
+            if (!contains(entry.code_offset, entry.code_size, sizeof(Instruction)) ||
+                !contains(entry.constant_offset, entry.constant_nr, sizeof(Slot)) ||
+                _product->functions.find(name) != _product->functions.end()) {
+                return false;
+            }
+
+            auto vm_func = new VMFunction(name, _product->vm_function_nr++);
+            auto constants = reinterpret_cast<const Slot *>(image + entry.constant_offset);
+            vm_func->register_nr = entry.register_nr;
+            vm_func->argument_nr = entry.argument_nr;
+            vm_func->mapped_code = reinterpret_cast<const Instruction *>(image + entry.code_offset);
+            vm_func->mapped_code_size = entry.code_size;
+            vm_func->constant_pool.assign(constants, constants + entry.constant_nr);
+
+            _product->functions.emplace(name, std::unique_ptr<Function>(vm_func));
+            function_table.push_back(vm_func);
+            if (!validateCode(vm_func, header->global_nr)) {
+                return false;
+            }
+        }
+        else {
+            return false;
+        }
+    }
+
+    // heap and global pointers are relocated by each Context against its own copies
+    auto resolve = [&] (const ImageSlot &slot, Relocation::Base &base, Slot &value) {
+        base = Relocation::R_ABSOLUTE;
+        value = slot.value;
+        switch (slot.kind) {
+            case ImageSlot::S_DATA:
+                return true;
+            case ImageSlot::S_STRING:
+                value = reinterpret_cast<Slot>(image + header->string_pool_offset + slot.value);
+                return slot.value < header->string_pool_size;
+            case ImageSlot::S_FUNCTION:
+                if (slot.value >= function_table.size()) { return false; }
+                value = reinterpret_cast<Slot>(function_table[slot.value]);
+                return true;
+            case ImageSlot::S_GLOBAL:
+                base = Relocation::R_GLOBALS;
+                return slot.value < header->global_nr * sizeof(Slot);
+            case ImageSlot::S_HEAP:
+                base = Relocation::R_HEAP;
+                return slot.value < header->heap_size;
+            default:
+                return false;
+        }
+    };
+
+    auto &globals = _product->globals;
+    auto global_entries = reinterpret_cast<const ImageSlot *>(image + header->global_offset);
+    globals.resize(header->global_nr);
+    for (size_t i = 0; i < header->global_nr; ++i) {
+        Relocation::Base base;
+        if (!resolve(global_entries[i], base, globals[i])) { return false; }
+
+        if (base != Relocation::R_ABSOLUTE) {
+            _product->relocations.push_back(Relocation{false, i * sizeof(Slot), base, globals[i]});
+            globals[i] = 0;
+        }
+    }
+
+    // compiled code trusts these slots to name their function
+    for (size_t i = 0; i < header->function_nr; ++i) {
+        auto &slot = global_entries[header->function_slot_base + i];
+        if (slot.kind != ImageSlot::S_FUNCTION || slot.value != i) { return false; }
+    }
+    _product->function_slot_base = header->function_slot_base;
+    _product->function_slot_nr = header->function_nr;
+
+    auto relocation_entries = reinterpret_cast<const ImageRelocation *>(image + header->relocation_offset);
+    for (size_t i = 0; i < header->relocation_nr; ++i) {
+        auto &entry = relocation_entries[i];
+        Relocation relocation{true, entry.offset, Relocation::R_ABSOLUTE, 0};
+        if (entry.offset % sizeof(Slot) ||
+            entry.offset >= header->heap_size ||
+            !resolve(entry.slot, relocation.base, relocation.value)) {
+            return false;
+        }
+        _product->relocations.push_back(relocation);
+    }
+
+    _product->heap_offset = header->heap_offset;
+    _product->heap_size = header->heap_size;
+    _product->initialized = header->flags & ImageHeader::F_INITIALIZED;
+    return true;
+}
+
+std::unique_ptr<vm::Program::Load>
+vm::Program::LoadFactory()
+{ return std::unique_ptr<Load>(new Load(new Program())); }
@@ -0,0 +1,61 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include "libcyan.hpp"
+#include "vm.hpp"
+#include "lib_functions.hpp"
+
+using namespace cyan;
+
+static const int64_t CALL_NR = 10000000;
+
+int
+main(int argc, const char **argv)
+{
+    if (argc < 2) {
+        std::cout << "Usage: embed_bench file [-j]" << std::endl;
+        return -1;
+    }
+    bool jit = argc > 2 && !std::strcmp(argv[2], "-j");
+
+    Parser parser(new ScreenOutputErrorCollector());
+    if (!parser.parseFile(argv[1])) {
+        return -1;
+    }
+
+    auto gen = vm::Program::GenerateFactory(OptimizerLevel2(parser.release().release()).release());
+    registerLibFunctions(gen.get());
+    gen->generate();
+    gen->optimize();
+    auto program = gen->release();
+
+    try {
+        auto add = program->prepare<int64_t(int64_t, int64_t)>("add");
+
+        vm::Context context(program.get());
+        if (jit) {
+            context.setupJIT();
+        }
+        else {
+            context.setup();
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        int64_t sum = 0;
+        for (int64_t i = 0; i < CALL_NR; ++i) {
+            sum = add(context, sum, i);
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+        std::cout << "sum " << sum << std::endl;
+        std::cout << CALL_NR << " calls in " << nanoseconds / 1000000 << "ms, "
+                  << static_cast<double>(nanoseconds) / CALL_NR << "ns per call" << std::endl;
+    }
+    catch (const std::exception &e) {
+        std::cout << e.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
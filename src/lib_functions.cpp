@@ -9,40 +9,36 @@ using Slot = vm::Slot;
 
 namespace {
 
-struct PrintStr : public vm::LibFunction
-{
-    virtual Slot
-    call(const Slot *arguments)
-    {
-        std::cout << reinterpret_cast<const char *>(arguments[0]);
-        std::cout.flush();
-        return 0;
-    }
-};
-
-struct PrintInt : public vm::LibFunction
-{
-    virtual Slot
-    call(const Slot *arguments)
-    {
-        std::cout << arguments[0];
-        return 0;
-    }
-};
-
-struct Rand : public vm::LibFunction
+void
+printStr(const char *str)
 {
-    virtual Slot
-    call(const Slot *arguments)
-    { return std::rand(); }
-};
-
+    std::cout << str;
+    std::cout.flush();
 }
 
 void
-cyan::registerLibFunctions(vm::VirtualMachine::Generate *gen)
+printInt(Slot value)
+{ std::cout << value; }
+
+int64_t
+randInt()
+{ return std::rand(); }
+
+template <typename T>
+void
+registerAll(T *target)
 {
-    gen->registerLibFunction("print_str", new PrintStr());
-    gen->registerLibFunction("print_int", new PrintInt());
-    gen->registerLibFunction("rand", new Rand());
+    target->registerLibFunction("print_str", vm::bindNative(printStr));
+    target->registerLibFunction("print_int", vm::bindNative(printInt));
+    target->registerLibFunction("rand", vm::bindNative(randInt));
 }
+
+}
+
+void
+cyan::registerLibFunctions(vm::Program::Generate *gen)
+{ registerAll(gen); }
+
+void
+cyan::registerLibFunctions(vm::Program::Load *load)
+{ registerAll(load); }
@@ -5,7 +5,8 @@
 
 namespace cyan {
 
-void registerLibFunctions(vm::VirtualMachine::Generate *gen);
+void registerLibFunctions(vm::Program::Generate *gen);
+void registerLibFunctions(vm::Program::Load *load);
 
 }
 
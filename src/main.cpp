@@ -25,18 +25,22 @@ struct Exception : public std::exception
 void
 print_help()
 {
-    static const int OPTIONS_COLUMN_SIZE = 16;
+    static const int OPTIONS_COLUMN_SIZE = 20;
     static const char *OPTIONS_PAIR[][2] = {
         {"-d",                  "output debug info to stderr"},
-        {"-e <GCC|IR|X64>",     "pass to GCC or emitting IR code or assembly"},
+        {"-e <GCC|IR|X64|VM>",  "pass to GCC or emitting IR code, assembly or VM image"},
         {"-h",                  "print this help"},
         {"-j",                  "run the code with JIT engine"},
+        {"-m <size>",           "VM stack size in KB"},
         {"-o <file>",           "define output file"},
         {"-O0",                 "no optimization"},
         {"-O1",                 "basic optimization"},
         {"-O2",                 "normal optimization"},
         {"-O3",                 "full optimization"},
-        {"-r",                  "run the code"},
+        {"-r",                  "run the code or a VM image"},
+        {"-s",                  "run _init_ before emitting a VM image"},
+        {"-t",                  "run the code tiered, JIT compiling hot functions"},
+        {"-T <calls,loops>",    "calls or loop back-edges before a function is compiled"},
         {"-v",                  "show version"},
     };
 
@@ -70,7 +74,12 @@ struct Config
     std::unique_ptr<Parser> parser;
     bool run;
     bool jit;
+    bool tiered;
     bool debug_out;
+    bool snapshot;
+    size_t stack_size;
+    uint32_t call_threshold;
+    uint32_t back_edge_threshold;
 
 private:
     Config()
@@ -86,7 +95,12 @@ private:
           parser(new Parser(error_collector)),
           run(false),
           jit(false),
-          debug_out(false)
+          tiered(false),
+          debug_out(false),
+          snapshot(false),
+          stack_size(vm::Context::STACK_SIZE),
+          call_threshold(vm::Context::CALL_THRESHOLD),
+          back_edge_threshold(vm::Context::BACK_EDGE_THRESHOLD)
     { }
 
 public:
@@ -146,9 +160,43 @@ public:
                     case 'j':
                         ret->jit = true;
                         break;
+                    case 't':
+                        ret->tiered = true;
+                        break;
+                    case 'T':
+                    {
+                        --argc; ++argv;
+                        char *end;
+                        ret->call_threshold = std::strtoul(*argv, &end, 10);
+                        if (*end == ',') {
+                            ret->back_edge_threshold = std::strtoul(end + 1, &end, 10);
+                        }
+                        if (*end || !ret->call_threshold || !ret->back_edge_threshold) {
+                            ret->error_collector->error(
+                                Exception(std::string("invalid thresholds: ") + *argv)
+                            );
+                            print_help();
+                            exit(-1);
+                        }
+                        break;
+                    }
+                    case 'm':
+                        --argc; ++argv;
+                        ret->stack_size = std::strtoul(*argv, nullptr, 10) * 1024;
+                        if (!ret->stack_size) {
+                            ret->error_collector->error(
+                                Exception(std::string("invalid stack size: ") + *argv)
+                            );
+                            print_help();
+                            exit(-1);
+                        }
+                        break;
                     case 'd':
                         ret->debug_out = true;
                         break;
+                    case 's':
+                        ret->snapshot = true;
+                        break;
                     default:
                         ret->error_collector->error(
                             Exception(std::string("unknown option: ") + *argv)
@@ -181,6 +229,9 @@ public:
             else if (ret->emit_code == "GCC") {
                 ret->output_file = "a.out";
             }
+            else if (ret->emit_code == "VM") {
+                ret->output_file = "a.vm";
+            }
             else {
                 assert(false);
             }
@@ -197,11 +248,59 @@ get_env(std::string name)
     return var ? var : "";
 }
 
+int
+run_vm(Config *config, vm::Program *program)
+{
+    try {
+        vm::Context context(program, config->stack_size);
+
+        // errors inside compiled code can't unwind to the catch below
+        context.setFatalHandler([config] (const std::exception &e) {
+            config->error_collector->error(e);
+            std::exit(-1);
+        });
+
+        auto ret_val = config->tiered ? context.startTiered(config->call_threshold, config->back_edge_threshold)
+                     : config->run    ? context.start()
+                     : context.startJIT();
+
+        if (config->debug_out) {
+            auto &stats = context.allocatorStats();
+            std::cerr << "allocations: " << stats.allocations << ", frees: " << stats.frees
+                      << ", bytes: " << stats.bytes << ", live objects: " << stats.live_objects
+                      << ", chunks: " << stats.chunks << std::endl;
+        }
+
+        std::cout << "exit with code " << ret_val << std::endl;
+        return ret_val;
+    }
+    catch (const vm::Context::StackOverflowException &e) {
+        config->error_collector->error(e);
+        return -1;
+    }
+    catch (const vm::MapFailedException &e) {
+        config->error_collector->error(e);
+        return -1;
+    }
+}
+
 int
 main(int argc, const char **argv)
 {
     auto config = Config::factory(argc, argv);
 
+    if ((config->run || config->jit || config->tiered) &&
+        config->input_files.size() == 1 &&
+        vm::Program::isImage(config->input_files.front().c_str())) {
+        auto load = vm::Program::LoadFactory();
+        registerLibFunctions(load.get());
+        if (!load->load(config->input_files.front().c_str())) {
+            config->error_collector->error(Exception("cannot load image: " + config->input_files.front()));
+            exit(-1);
+        }
+        return run_vm(config.get(), load->release().get());
+    }
+
     for (auto &input_file : config->input_files) {
         if (!config->parser->parseFile(input_file.c_str())) {
             exit(-1);
@@ -230,26 +329,14 @@ main(int argc, const char **argv)
         }
     }
 
-    if (config->run) {
-        auto gen = vm::VirtualMachine::GenerateFactory(ir.release());
+    if (config->run || config->jit || config->tiered) {
+        auto gen = vm::Program::GenerateFactory(ir.release());
         registerLibFunctions(gen.get());
         gen->generate();
-        auto vm = gen->release();
-        auto ret_val = vm->start();
-
-        std::cout << "exit with code " << ret_val << std::endl;
-        return ret_val;
-    }
-
-    if (config->jit) {
-        auto gen = vm::VirtualMachine::GenerateFactory(ir.release());
-        registerLibFunctions(gen.get());
-        gen->generate();
-        auto vm = gen->release();
-        auto ret_val = vm->startJIT();
-
-        std::cout << "exit with code " << ret_val << std::endl;
-        return ret_val;
+        if (config->optimize_level >= 2) {
+            gen->optimize();
+        }
+        return run_vm(config.get(), gen->release().get());
     }
 
     if (config->emit_code == "IR") {
@@ -276,6 +363,35 @@ main(int argc, const char **argv)
         std::system(("gcc -m64 -o " + config->output_file + " " + temp_name + " " + runtime_path).c_str());
         std::system(("rm " + temp_name).c_str());
     }
+    else if (config->emit_code == "VM") {
+        auto gen = vm::Program::GenerateFactory(ir.release());
+        registerLibFunctions(gen.get());
+        gen->generate();
+        if (config->optimize_level >= 2) {
+            gen->optimize();
+        }
+
+        auto program = gen->release();
+        std::ofstream output(config->output_file, std::ios::binary);
+        if (config->snapshot) {
+            try {
+                vm::Context context(program.get(), config->stack_size);
+                context.initialize();
+                program->saveImage(output, &context);
+            }
+            catch (const vm::Context::StackOverflowException &e) {
+                config->error_collector->error(e);
+                return -1;
+            }
+            catch (const vm::MapFailedException &e) {
+                config->error_collector->error(e);
+                return -1;
+            }
+        }
+        else {
+            program->saveImage(output);
+        }
+    }
     else {
         config->error_collector->error(Exception("unknown emitting: " + config->emit_code));
     }
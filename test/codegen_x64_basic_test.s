@@ -0,0 +1,27 @@
+.intel_syntax
+
+.data
+	a:	.quad 0
+
+
+.text
+	.globl _init_
+	.type _init_ @function
+_init_:
+	push %rbp
+	mov %rbp, %rsp
+	sub %rsp, 0
+	push %rbx
+	
+_init__BB_0:
+	mov %rbx, 1
+	add %rbx, 2
+	mov QWORD PTR [a], %rbx
+
+_init__exit:
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+_init_.end:
+	.size _init_, .-_init_
+
@@ -0,0 +1,85 @@
+.intel_syntax
+
+.text
+	.globl _init_
+	.type _init_ @function
+_init_:
+	push %rbp
+	mov %rbp, %rsp
+	sub %rsp, 0
+
+_init__exit:
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+_init_.end:
+	.size _init_, .-_init_
+
+	.globl main
+	.type main @function
+main:
+	push %rbp
+	mov %rbp, %rsp
+	push %rdi
+	sub %rsp, 16
+	push %rbx
+	
+main_entry:
+	mov QWORD PTR [%rbp-56], 10
+	mov QWORD PTR [%rbp-64], 5
+	// preserving
+	mov %rdi, QWORD PTR [%rbp-56]
+	mov %rsi, QWORD PTR [%rbp-64]
+	call max
+	mov %rbx, %rax
+	// restoring
+	// preserving
+	mov %rdi, QWORD PTR [%rbp-56]
+	mov %rsi, QWORD PTR [%rbp-64]
+	call max
+	mov %rbx, %rax
+	// restoring
+	mov %rax, %rbx
+
+main_exit:
+	pop %rbx
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+main.end:
+	.size main, .-main
+
+	.globl max
+	.type max @function
+max:
+	push %rbp
+	mov %rbp, %rsp
+	push %rdi
+	push %rsi
+	push %rdx
+	sub %rsp, 0
+	push %rbx
+	
+max_entry:
+	mov %rax, QWORD PTR [%rbp-8]
+	cmp QWORD PTR [%rbp-16], %rax
+	jge max_BB_6
+	
+max_BB_5:
+	mov %rbx, QWORD PTR [%rbp-8]
+	jmp max_BB_7
+	
+max_BB_6:
+	mov %rbx, QWORD PTR [%rbp-16]
+	
+max_BB_7:
+	mov %rax, %rbx
+
+max_exit:
+	pop %rbx
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+max.end:
+	.size max, .-max
+
@@ -0,0 +1,50 @@
+.intel_syntax
+
+.text
+	.globl _init_
+	.type _init_ @function
+_init_:
+	push %rbp
+	mov %rbp, %rsp
+	sub %rsp, 0
+
+_init__exit:
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+_init_.end:
+	.size _init_, .-_init_
+
+	.globl main
+	.type main @function
+main:
+	push %rbp
+	mov %rbp, %rsp
+	push %rdi
+	sub %rsp, 8
+	push %rbx
+	
+main_entry:
+	mov QWORD PTR [%rbp-56], 0
+	
+main_BB_3:
+	cmp QWORD PTR [%rbp-56], 10
+	jl main_BB_8
+	
+main_BB_4:
+	jmp main_exit
+	
+main_BB_8:
+	mov %rbx, QWORD PTR [%rbp-56]
+	add %rbx, 1
+	mov QWORD PTR [%rbp-56], %rbx
+	jmp main_BB_3
+
+main_exit:
+	pop %rbx
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+main.end:
+	.size main, .-main
+
@@ -0,0 +1,60 @@
+.intel_syntax
+
+.data
+	a:	.quad 0
+
+
+.text
+	.globl _init_
+	.type _init_ @function
+_init_:
+	push %rbp
+	mov %rbp, %rsp
+	sub %rsp, 0
+	push %rbx
+	
+_init__BB_0:
+	mov %rbx, 1
+	add %rbx, 2
+	mov QWORD PTR [a], %rbx
+
+_init__exit:
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+_init_.end:
+	.size _init_, .-_init_
+
+	.globl main
+	.type main @function
+main:
+	push %rbp
+	mov %rbp, %rsp
+	push %rdi
+	sub %rsp, 8
+	push %rbx
+	
+main_entry:
+	mov QWORD PTR [%rbp-56], 1
+	cmp QWORD PTR [a], 2
+	jne main_BB_8
+	
+main_BB_7:
+	mov %rbx, QWORD PTR [%rbp-56]
+	mov %rax, %rbx
+	jmp main_exit
+	
+main_BB_8:
+	
+main_BB_10:
+	mov %rbx, QWORD PTR [a]
+	mov %rax, %rbx
+
+main_exit:
+	pop %rbx
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+main.end:
+	.size main, .-main
+
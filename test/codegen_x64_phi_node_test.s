@@ -0,0 +1,52 @@
+.intel_syntax
+
+.data
+	a:	.quad 0
+
+
+.text
+	.globl _init_
+	.type _init_ @function
+_init_:
+	push %rbp
+	mov %rbp, %rsp
+	sub %rsp, 0
+	push %rbx
+	
+_init__BB_0:
+	mov %rbx, 1
+	cmp %rbx, 0
+	jne _init__BB_4
+	
+_init__BB_2:
+	cmp %rbx, 0
+	jne _init__BB_6
+	jmp _init__BB_8
+	
+_init__BB_4:
+	mov %rbx, 2
+	jmp _init__BB_2
+	
+_init__BB_6:
+	mov QWORD PTR [a], %rbx
+	jmp _init__exit
+	
+_init__BB_8:
+	mov %rbx, 3
+	cmp %rbx, 0
+	jne _init__BB_12
+	
+_init__BB_10:
+	jmp _init__BB_6
+	
+_init__BB_12:
+	mov %rbx, 4
+	jmp _init__BB_10
+
+_init__exit:
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+_init_.end:
+	.size _init_, .-_init_
+
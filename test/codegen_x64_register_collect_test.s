@@ -0,0 +1,49 @@
+.intel_syntax
+
+.text
+	.globl _init_
+	.type _init_ @function
+_init_:
+	push %rbp
+	mov %rbp, %rsp
+	sub %rsp, 0
+
+_init__exit:
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+_init_.end:
+	.size _init_, .-_init_
+
+	.globl main
+	.type main @function
+main:
+	push %rbp
+	mov %rbp, %rsp
+	push %rdi
+	sub %rsp, 24
+	push %rbx
+	
+main_entry:
+	mov %rbx, 1
+	sub %rbx, 2
+	mov %rcx, 1
+	add %rcx, 2
+	imul %rbx, %rcx
+	mov QWORD PTR [%rbp-56], %rbx
+	mov %rbx, QWORD PTR [%rbp-56]
+	imul %rbx, 3
+	add %rbx, 4
+	mov QWORD PTR [%rbp-64], %rbx
+	mov %rbx, QWORD PTR [%rbp-64]
+	add %rbx, QWORD PTR [%rbp-56]
+	mov QWORD PTR [%rbp-72], %rbx
+
+main_exit:
+	pop %rbx
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+main.end:
+	.size main, .-main
+
@@ -0,0 +1,76 @@
+.intel_syntax
+
+.text
+	.globl _init_
+	.type _init_ @function
+_init_:
+	push %rbp
+	mov %rbp, %rsp
+	sub %rsp, 0
+
+_init__exit:
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+_init_.end:
+	.size _init_, .-_init_
+
+	.globl callee
+	.type callee @function
+callee:
+	push %rbp
+	mov %rbp, %rsp
+	push %rdi
+	push %rsi
+	push %rdx
+	push %rcx
+	push %r8
+	push %r9
+	sub %rsp, 0
+	
+callee_entry:
+
+callee_exit:
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+callee.end:
+	.size callee, .-callee
+
+	.globl main
+	.type main @function
+main:
+	push %rbp
+	mov %rbp, %rsp
+	push %rdi
+	sub %rsp, 0
+	push %rbx
+	
+main_entry:
+	// preserving
+	mov %rdi, 1
+	mov %rsi, 2
+	mov %rdx, 3
+	mov %rcx, 4
+	mov %r8, 5
+	mov %r9, 6
+	mov %rbx, 10
+	mov %rcx, 9
+	mov %rsi, 8
+	mov %rdi, 7
+	push %rbx
+	push %rcx
+	push %rsi
+	push %rdi
+	call callee
+	mov %rbx, %rax
+	// restoring
+
+main_exit:
+	pop %rbx
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+main.end:
+	.size main, .-main
+
@@ -0,0 +1,41 @@
+.intel_syntax
+
+.data
+	a:	.quad 0
+
+
+.text
+	.globl _init_
+	.type _init_ @function
+_init_:
+	push %rbp
+	mov %rbp, %rsp
+	sub %rsp, 0
+	push %rbx
+	
+_init__BB_0:
+	mov %rbx, 15
+	imul %rbx, 15
+	add %rbx, 14
+	imul %rbx, 13
+	add %rbx, 12
+	imul %rbx, 11
+	add %rbx, 10
+	imul %rbx, 9
+	add %rbx, 8
+	imul %rbx, 7
+	add %rbx, 6
+	imul %rbx, 5
+	add %rbx, 4
+	imul %rbx, 3
+	add %rbx, 2
+	imul %rbx, 1
+	mov QWORD PTR [a], %rbx
+
+_init__exit:
+	mov %rsp, %rbp
+	pop %rbp
+	ret
+_init_.end:
+	.size _init_, .-_init_
+
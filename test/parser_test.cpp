@@ -66,6 +66,45 @@ TEST(parser_test, multiple_let_test)
     // uut->release()->output(std::cout);
 }
 
+TEST(parser_test, multiple_let_init_test)
+{
+    static const char SOURCE[] =
+        "let a = 1;\n"
+        "let b = a + 1;\n"
+        "let c = a + b;\n"
+    ;
+
+    Parser *uut = new Parser(new ScreenOutputErrorCollector());
+    ASSERT_TRUE(uut->parse(SOURCE));
+
+    auto ir = uut->release();
+    EXPECT_EQ(3u, ir->global_defines.size());
+
+    // every definition runs, each block of _init_ falls through to the next
+    auto &block_list = ir->function_table.at("_init_")->block_list;
+    ASSERT_EQ(3u, block_list.size());
+    for (auto iter = block_list.begin(); std::next(iter) != block_list.end(); ++iter) {
+        EXPECT_EQ(nullptr, (*iter)->condition);
+        EXPECT_EQ(std::next(iter)->get(), (*iter)->then_block);
+    }
+    EXPECT_EQ(nullptr, block_list.back()->then_block);
+}
+
+TEST(parser_test, let_after_declaration_test)
+{
+    static const char SOURCE[] =
+        "function print_int(value : i64);\n"
+        "let a = 1;\n"
+    ;
+
+    Parser *uut = new Parser(new ScreenOutputErrorCollector());
+    ASSERT_TRUE(uut->parse(SOURCE));
+
+    // a declaration leaves its prototype scope, a is still defined at the top level
+    auto ir = uut->release();
+    EXPECT_EQ(1u, ir->global_defines.count("a"));
+}
+
 TEST(parser_test, function_test)
 {
     static const char SOURCE[] =
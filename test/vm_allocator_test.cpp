@@ -0,0 +1,180 @@
+#include <set>
+
+#include "gtest/gtest.h"
+
+#include "../lib/libcyan.hpp"
+#include "../lib/vm.hpp"
+
+using namespace cyan::vm;
+
+namespace {
+
+const char SOURCE[] =
+    "struct Pair {\n"
+    "    first : i64,\n"
+    "    second : i64\n"
+    "}\n"
+    "function main() : i64 {\n"
+    "    let sum = 0;\n"
+    "    let kept = new Pair;\n"
+    "    let i = 0;\n"
+    "    while (i < 1000) {\n"
+    "        let pair = new Pair;\n"
+    "        pair.first = i;\n"
+    "        pair.second = i * 2;\n"
+    "        let small = new i8[1];\n"
+    "        let large = new i8[300];\n"
+    "        small[0] = 1;\n"
+    "        large[299] = 2;\n"
+    "        sum = sum + pair.first + pair.second + small[0] + large[299];\n"
+    "        delete pair;\n"
+    "        delete small;\n"
+    "        delete large;\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "    kept.first = sum;\n"
+    "    return kept.first;\n"
+    "}\n"
+;
+
+const Slot EXPECTED = 3 * (999 * 1000 / 2) + 3 * 1000;
+
+inline Slot
+header(void *object)
+{ return static_cast<Slot *>(object)[-1]; }
+
+std::unique_ptr<Program>
+generate()
+{
+    cyan::Parser parser(new cyan::ScreenOutputErrorCollector());
+    EXPECT_TRUE(parser.parse(SOURCE));
+
+    auto gen = Program::GenerateFactory(cyan::OptimizerLevel0(parser.release().release()).release());
+    gen->generate();
+    return gen->release();
+}
+
+void
+checkStats(const ObjectAllocator::Stats &stats)
+{
+    EXPECT_EQ(3001u, stats.allocations);
+    EXPECT_EQ(3000u, stats.frees);
+    EXPECT_EQ(1u, stats.live_objects);
+    EXPECT_EQ(1u, stats.chunks);
+}
+
+}
+
+TEST(vm_allocator_test, size_class_test)
+{
+    ObjectAllocator allocator;
+
+    EXPECT_EQ(0u, header(allocator.allocate(0)));
+    EXPECT_EQ(1u, header(allocator.allocate(1)));
+    EXPECT_EQ(1u, header(allocator.allocate(8)));
+    EXPECT_EQ(2u, header(allocator.allocate(9)));
+    EXPECT_EQ(ObjectAllocator::CLASS_NR - 1, header(allocator.allocate(256)));
+    EXPECT_EQ(static_cast<Slot>(ObjectAllocator::LARGE_CLASS), header(allocator.allocate(257)));
+
+    // the large object comes from malloc, not from a chunk
+    EXPECT_EQ(1u, allocator.stats.chunks);
+}
+
+TEST(vm_allocator_test, blocks_test)
+{
+    ObjectAllocator allocator;
+
+    // blocks of a chunk don't overlap, and objects are slot aligned
+    std::set<Slot> objects;
+    for (size_t size = 0; size <= ObjectAllocator::MAX_SMALL_SIZE; ++size) {
+        auto object = reinterpret_cast<Slot>(allocator.allocate(size));
+        EXPECT_EQ(0u, object % sizeof(Slot));
+        auto next = objects.upper_bound(object);
+        if (next != objects.end()) {
+            EXPECT_LE(object + size, *next - sizeof(Slot));
+        }
+        objects.insert(object);
+    }
+}
+
+TEST(vm_allocator_test, reuse_test)
+{
+    ObjectAllocator allocator;
+
+    auto first = allocator.allocate(24);
+    allocator.release(first);
+
+    // a freed block serves the next object of its class only
+    auto other_class = allocator.allocate(32);
+    EXPECT_NE(first, other_class);
+    auto same_class = allocator.allocate(17);
+    EXPECT_EQ(first, same_class);
+    EXPECT_EQ(3u, header(same_class));
+
+    // last freed, first reused
+    auto a = allocator.allocate(16);
+    auto b = allocator.allocate(16);
+    allocator.release(a);
+    allocator.release(b);
+    EXPECT_EQ(b, allocator.allocate(16));
+    EXPECT_EQ(a, allocator.allocate(16));
+
+    auto large = allocator.allocate(1000);
+    allocator.release(large);
+    EXPECT_EQ(static_cast<Slot>(ObjectAllocator::LARGE_CLASS), header(allocator.allocate(1000)));
+}
+
+TEST(vm_allocator_test, chunk_test)
+{
+    ObjectAllocator allocator;
+
+    auto per_chunk = (ObjectAllocator::CHUNK_SIZE - sizeof(char *)) /
+                     ObjectAllocator::blockSize(ObjectAllocator::CLASS_NR - 1);
+    for (size_t i = 0; i < per_chunk; ++i) {
+        allocator.allocate(ObjectAllocator::MAX_SMALL_SIZE);
+    }
+    EXPECT_EQ(1u, allocator.stats.chunks);
+
+    allocator.allocate(ObjectAllocator::MAX_SMALL_SIZE);
+    EXPECT_EQ(2u, allocator.stats.chunks);
+}
+
+TEST(vm_allocator_test, stats_test)
+{
+    ObjectAllocator allocator;
+
+    auto a = allocator.allocate(10);
+    auto b = allocator.allocate(300);
+    allocator.allocate(0);
+    EXPECT_EQ(3u, allocator.stats.allocations);
+    EXPECT_EQ(310u, allocator.stats.bytes);
+    EXPECT_EQ(3u, allocator.stats.live_objects);
+    EXPECT_EQ(0u, allocator.stats.frees);
+
+    allocator.release(a);
+    allocator.release(b);
+    EXPECT_EQ(3u, allocator.stats.allocations);
+    EXPECT_EQ(2u, allocator.stats.frees);
+    EXPECT_EQ(1u, allocator.stats.live_objects);
+}
+
+TEST(vm_allocator_test, interpreter_test)
+{
+    auto program = generate();
+    Context context(program.get());
+    EXPECT_EQ(EXPECTED, context.start());
+    checkStats(context.allocatorStats());
+}
+
+TEST(vm_allocator_test, jit_test)
+{
+    auto program = generate();
+    Context context(program.get());
+    EXPECT_EQ(EXPECTED, context.startJIT());
+    checkStats(context.allocatorStats());
+
+    // the inlined fast path counts the same bytes as the interpreter
+    Context interpreted(program.get());
+    interpreted.start();
+    EXPECT_EQ(interpreted.allocatorStats().bytes, context.allocatorStats().bytes);
+}
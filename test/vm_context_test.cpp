@@ -0,0 +1,135 @@
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "../lib/libcyan.hpp"
+#include "../lib/vm.hpp"
+
+using namespace cyan::vm;
+
+namespace {
+
+constexpr size_t THREAD_NR = 8;
+constexpr size_t CONTEXT_NR = 5;    // run one after another on each thread
+
+// a context sharing globals with another one would count past 1000
+const char SOURCE[] =
+    "let counter = 0;\n"
+    "function fib(n : i64) : i64 {\n"
+    "    if (n < 2) {\n"
+    "        return n;\n"
+    "    }\n"
+    "    return fib(n - 1) + fib(n - 2);\n"
+    "}\n"
+    "function main() : i64 {\n"
+    "    let i = 0;\n"
+    "    while (i < 1000) {\n"
+    "        counter = counter + 1;\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "    return counter + fib(15);\n"
+    "}\n"
+;
+
+const Slot EXPECTED = 1000 + 610;
+
+// the same for the heap, shared is allocated by _init_
+const char HEAP_SOURCE[] =
+    "struct Counter {\n"
+    "    value : i64\n"
+    "}\n"
+    "function make() : Counter {\n"
+    "    let counter = new Counter;\n"
+    "    counter.value = 0;\n"
+    "    return counter;\n"
+    "}\n"
+    "let shared = make();\n"
+    "function main() : i64 {\n"
+    "    let i = 0;\n"
+    "    while (i < 1000) {\n"
+    "        shared.value = shared.value + 2;\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "    return shared.value;\n"
+    "}\n"
+;
+
+const Slot HEAP_EXPECTED = 2000;
+
+std::unique_ptr<Program>
+generate(const char *source)
+{
+    cyan::Parser parser(new cyan::ScreenOutputErrorCollector());
+    EXPECT_TRUE(parser.parse(source));
+
+    auto gen = Program::GenerateFactory(cyan::OptimizerLevel0(parser.release().release()).release());
+    gen->generate();
+    return gen->release();
+}
+
+// contexts rotate through the interpreter, the JIT and tiered runs, the first of each threads or compiles the code
+std::vector<Slot>
+runConcurrently(const Program *program)
+{
+    std::vector<Slot> results(THREAD_NR * CONTEXT_NR);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < THREAD_NR; ++t) {
+        threads.emplace_back([program, t, &results] () {
+            for (size_t c = 0; c < CONTEXT_NR; ++c) {
+                Context context(program);
+                switch ((t + c) % 3) {
+                    case 0: results[t * CONTEXT_NR + c] = context.start(); break;
+                    case 1: results[t * CONTEXT_NR + c] = context.startJIT(); break;
+                    case 2: results[t * CONTEXT_NR + c] = context.startTiered(2, 3); break;
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    return results;
+}
+
+}
+
+TEST(vm_context_test, concurrent_contexts_test)
+{
+    auto program = generate(SOURCE);
+    for (auto result : runConcurrently(program.get())) {
+        EXPECT_EQ(EXPECTED, result);
+    }
+}
+
+TEST(vm_context_test, concurrent_heap_test)
+{
+    auto program = generate(HEAP_SOURCE);
+    for (auto result : runConcurrently(program.get())) {
+        EXPECT_EQ(HEAP_EXPECTED, result);
+    }
+}
+
+TEST(vm_context_test, concurrent_snapshot_test)
+{
+    auto generated = generate(HEAP_SOURCE);
+    {
+        Context context(generated.get());
+        context.initialize();
+
+        std::stringstream image;
+        generated->saveImage(image, &context);
+        std::ofstream("vm_context_test.vm", std::ios::binary) << image.str();
+    }
+
+    auto load = Program::LoadFactory();
+    ASSERT_TRUE(load->load("vm_context_test.vm"));
+    auto program = load->release();
+
+    // every context maps the heap holding shared on its own
+    for (auto result : runConcurrently(program.get())) {
+        EXPECT_EQ(HEAP_EXPECTED, result);
+    }
+}
@@ -0,0 +1,125 @@
+#include "gtest/gtest.h"
+
+#include "../lib/libcyan.hpp"
+#include "../lib/vm.hpp"
+
+using namespace cyan::vm;
+
+namespace {
+
+const char SOURCE[] =
+    "function host(n : i64) : i64;\n"
+    "let base = 100;\n"
+    "function add(a : i64, b : i64) : i64 {\n"
+    "    return a + b + base;\n"
+    "}\n"
+    "function negate(a : i32) : i32 {\n"
+    "    return 0 - a;\n"
+    "}\n"
+    "function second(s : i8[]) : i64 {\n"
+    "    return s[1];\n"
+    "}\n"
+    "function bump() {\n"
+    "    base = base + 1;\n"
+    "}\n"
+    "function down(n : i64) : i64 {\n"
+    "    if (n == 0) {\n"
+    "        return 0;\n"
+    "    }\n"
+    "    return host(n - 1) + 1;\n"
+    "}\n"
+    "function main() : i64 {\n"
+    "    return 0;\n"
+    "}\n"
+;
+
+enum class Color : int { RED = 1, GREEN = 2 };
+
+Context *host_context = nullptr;
+Handle<long(long)> *host_down = nullptr;
+
+// calls back into the VM, frames of the outer call are still live
+long
+host(long n)
+{ return (*host_down)(*host_context, n); }
+
+std::unique_ptr<Program>
+generate()
+{
+    cyan::Parser parser(new cyan::ScreenOutputErrorCollector());
+    EXPECT_TRUE(parser.parse(SOURCE));
+
+    auto gen = Program::GenerateFactory(cyan::OptimizerLevel0(parser.release().release()).release());
+    gen->registerLibFunction("host", bindNative(host));
+    gen->generate();
+    return gen->release();
+}
+
+void
+checkCalls(Context &context, const Program *program)
+{
+    auto add = program->prepare<long(long, long)>("add");
+    auto negate = program->prepare<int(int)>("negate");
+    auto color = program->prepare<Color(Color)>("negate");
+    auto second = program->prepare<long(const char *)>("second");
+    auto bump = program->prepare<void()>("bump");
+
+    EXPECT_EQ(103, add(context, 1, 2));
+    EXPECT_EQ(100 - 5, add(context, -2, -3));
+    EXPECT_EQ(-7, negate(context, 7));
+    EXPECT_EQ(static_cast<Color>(-2), color(context, Color::GREEN));
+    EXPECT_EQ('y', second(context, "xyz"));
+
+    // state of the context persists across calls
+    bump(context);
+    EXPECT_EQ(104, add(context, 1, 2));
+}
+
+}
+
+TEST(vm_handle_test, prepare_test)
+{
+    auto program = generate();
+
+    EXPECT_THROW(program->prepare<long(long)>("add"), Program::PrepareException);
+    EXPECT_THROW(program->prepare<long(long, long, long)>("add"), Program::PrepareException);
+    EXPECT_THROW(program->prepare<long()>("missing"), Program::PrepareException);
+    EXPECT_THROW(program->prepare<long(long)>("host"), Program::PrepareException);
+    EXPECT_NO_THROW(program->prepare<long(long, long)>("add"));
+}
+
+TEST(vm_handle_test, interpreter_call_test)
+{
+    auto program = generate();
+    Context context(program.get());
+    context.setup();
+    checkCalls(context, program.get());
+}
+
+TEST(vm_handle_test, jit_call_test)
+{
+    auto program = generate();
+    Context context(program.get());
+    context.setupJIT();
+    checkCalls(context, program.get());
+}
+
+TEST(vm_handle_test, reentrant_call_test)
+{
+    auto program = generate();
+    auto down = program->prepare<long(long)>("down");
+    host_down = &down;
+
+    for (auto jit : { false, true }) {
+        Context context(program.get());
+        host_context = &context;
+        jit ? context.setupJIT() : context.setup();
+
+        // deep enough to grow the frame vector under the outer calls
+        EXPECT_EQ(3000, down(context, 3000));
+        EXPECT_EQ(5, down(context, 5));
+    }
+
+    host_context = nullptr;
+    host_down = nullptr;
+}
@@ -0,0 +1,250 @@
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "../lib/libcyan.hpp"
+#include "../lib/vm.hpp"
+
+using namespace cyan::vm;
+
+namespace {
+
+const char SOURCE[] =
+    "function add(a : i64, b : i64) : i64 {\n"
+    "    return a + b;\n"
+    "}\n"
+    "function main() : i64 {\n"
+    "    let s = \"hello\";\n"
+    "    let sum = 0;\n"
+    "    let i = 0;\n"
+    "    while (i < 10) {\n"
+    "        sum = add(sum, i);\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "    return sum + s[1] + 1000000;\n"
+    "}\n"
+;
+
+const Slot EXPECTED = 45 + 'e' + 1000000;
+
+const char SNAPSHOT_SOURCE[] =
+    "struct Node {\n"
+    "    value : i64,\n"
+    "    name : i8[],\n"
+    "    next : Node\n"
+    "}\n"
+    "function build(n : i64) : Node {\n"
+    "    let head = new Node;\n"
+    "    head.value = 0;\n"
+    "    head.name = \"head\";\n"
+    "    let i = 1;\n"
+    "    while (i < n) {\n"
+    "        let node = new Node;\n"
+    "        node.value = i;\n"
+    "        node.name = \"node\";\n"
+    "        node.next = head;\n"
+    "        head = node;\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "    return head;\n"
+    "}\n"
+    "let count = 5;\n"
+    "let list = build(count);\n"
+    "let greeting = \"hi\";\n"
+    "function main() : i64 {\n"
+    "    let sum = 0;\n"
+    "    let node = list;\n"
+    "    let i = 0;\n"
+    "    while (i < count) {\n"
+    "        sum = sum + node.value;\n"
+    "        node = node.next;\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "    list.value = list.value + 100;\n"
+    "    return sum + list.value + list.name[0] + greeting[1];\n"
+    "}\n"
+;
+
+const Slot SNAPSHOT_EXPECTED = 10 + 104 + 'n' + 'i';
+
+std::unique_ptr<Program>
+generate(const char *source)
+{
+    cyan::Parser parser(new cyan::ScreenOutputErrorCollector());
+    EXPECT_TRUE(parser.parse(source));
+
+    auto gen = Program::GenerateFactory(cyan::OptimizerLevel0(parser.release().release()).release());
+    gen->generate();
+    return gen->release();
+}
+
+std::string
+save(const Program *program, const char *path, const Context *context = nullptr)
+{
+    std::stringstream image;
+    program->saveImage(image, context);
+    std::ofstream(path, std::ios::binary) << image.str();
+    return image.str();
+}
+
+std::unique_ptr<Program>
+load(const char *path)
+{
+    auto load = Program::LoadFactory();
+    if (!load->load(path)) {
+        return nullptr;
+    }
+    return load->release();
+}
+
+bool
+validate(const std::vector<Instruction> &code, size_t register_nr, size_t global_nr = 0)
+{
+    VMFunction func("test", 0);
+    func.inst_list = code;
+    func.register_nr = register_nr;
+    func.constant_pool.push_back(0);
+    return Program::validateCode(&func, global_nr);
+}
+
+}
+
+TEST(vm_image_test, round_trip_test)
+{
+    auto generated = generate(SOURCE);
+    auto image = save(generated.get(), "vm_image_test.vm");
+
+    ASSERT_TRUE(Program::isImage("vm_image_test.vm"));
+    auto loaded = load("vm_image_test.vm");
+    ASSERT_TRUE(loaded.get());
+
+    // saving a loaded image gives the same image back
+    std::stringstream saved;
+    loaded->saveImage(saved);
+    EXPECT_EQ(image, saved.str());
+
+    EXPECT_EQ(EXPECTED, Context(generated.get()).start());
+    EXPECT_EQ(EXPECTED, Context(loaded.get()).start());
+}
+
+TEST(vm_image_test, snapshot_test)
+{
+    auto generated = generate(SNAPSHOT_SOURCE);
+    {
+        Context context(generated.get());
+        context.initialize();
+        save(generated.get(), "vm_image_test_snapshot.vm", &context);
+    }
+
+    // _init_ does not run again, globals and the heap come from the image
+    auto loaded = load("vm_image_test_snapshot.vm");
+    ASSERT_TRUE(loaded.get());
+    Context context(loaded.get());
+    EXPECT_EQ(SNAPSHOT_EXPECTED, context.start());
+
+    // each context maps the heap privately, the head written by its first run is read twice by the second
+    EXPECT_EQ(SNAPSHOT_EXPECTED + 200, context.start());
+    EXPECT_EQ(SNAPSHOT_EXPECTED, Context(loaded.get()).start());
+
+    EXPECT_EQ(SNAPSHOT_EXPECTED, Context(generated.get()).start());
+}
+
+TEST(vm_image_test, corrupt_image_test)
+{
+    auto image = save(generate(SOURCE).get(), "vm_image_test_corrupt.vm");
+
+    // the instruction taking the large constant, an ADDI or a LI as the immediate fits, made unknown
+    bool patched = false;
+    for (size_t position = 0; !patched && position + sizeof(Instruction) <= image.size(); position += 8) {
+        Instruction inst(I_UNKNOWN, 0, 0, 0);
+        std::memcpy(&inst, image.data() + position, sizeof(inst));
+        if ((inst.i_op == I_ADDI && inst.i_simm == 1000000) ||
+                (inst.i_op == I_LI && static_cast<SignedImmediateT>(inst.i_imm) == 1000000)) {
+            inst.i_op = InstOperator_NR;
+            std::memcpy(&image[position], &inst, sizeof(inst));
+            patched = true;
+        }
+    }
+    ASSERT_TRUE(patched);
+
+    std::ofstream("vm_image_test_corrupt.vm", std::ios::binary) << image;
+    EXPECT_FALSE(load("vm_image_test_corrupt.vm").get());
+}
+
+TEST(vm_image_test, validate_register_nr_test)
+{
+    std::vector<Instruction> code = { Instruction(I_RET, 0, 0, 0, 0) };
+    EXPECT_TRUE(validate(code, 1));
+    EXPECT_FALSE(validate(code, 0));
+    EXPECT_FALSE(validate(code, static_cast<size_t>(std::numeric_limits<RegisterT>::max()) + 2));
+}
+
+TEST(vm_image_test, validate_last_instruction_test)
+{
+    EXPECT_TRUE(validate({ Instruction(I_LI, 0, 1, 1), Instruction(I_JUMP, 0, 0, 0) }, 2));
+    EXPECT_FALSE(validate({ Instruction(I_LI, 0, 1, 1) }, 2));
+    EXPECT_FALSE(validate({}, 2));
+}
+
+TEST(vm_image_test, validate_opcode_test)
+{
+    EXPECT_FALSE(validate({ Instruction(I_UNKNOWN, 0, 0, 0), Instruction(I_RET, 0, 0, 0, 0) }, 1));
+    EXPECT_FALSE(validate({ Instruction(InstOperator_NR, 0, 0, 0), Instruction(I_RET, 0, 0, 0, 0) }, 1));
+}
+
+TEST(vm_image_test, validate_register_test)
+{
+    EXPECT_TRUE(validate({ Instruction(I_ADD, 0, 1, 2, 3), Instruction(I_RET, 0, 0, 1, 0) }, 4));
+    EXPECT_FALSE(validate({ Instruction(I_ADD, 0, 1, 2, 4), Instruction(I_RET, 0, 0, 1, 0) }, 4));
+    EXPECT_FALSE(validate({ Instruction(I_ADD, 0, 4, 2, 3), Instruction(I_RET, 0, 0, 1, 0) }, 4));
+    EXPECT_FALSE(validate({ Instruction(I_RET, 0, 0, 4, 0) }, 4));
+}
+
+TEST(vm_image_test, validate_branch_target_test)
+{
+    EXPECT_TRUE(validate({ Instruction(I_BR, 0, 1, 1), Instruction(I_RET, 0, 0, 0, 0) }, 2));
+    EXPECT_FALSE(validate({ Instruction(I_BR, 0, 1, 2), Instruction(I_RET, 0, 0, 0, 0) }, 2));
+    EXPECT_FALSE(validate({ Instruction(I_BEQ, 0, 2, 1, 1), Instruction(I_RET, 0, 0, 0, 0) }, 2));
+}
+
+TEST(vm_image_test, validate_argument_test)
+{
+    EXPECT_TRUE(validate({ Instruction(I_ARG, 0, 1, 1), Instruction(I_RET, 0, 0, 1, 0) }, 3));
+    EXPECT_FALSE(validate({ Instruction(I_ARG, 0, 1, 2), Instruction(I_RET, 0, 0, 1, 0) }, 3));
+}
+
+TEST(vm_image_test, validate_call_window_test)
+{
+    EXPECT_TRUE(validate({ Instruction(I_CALL, 2, 1, 1, 2), Instruction(I_RET, 0, 0, 1, 0) }, 5));
+    EXPECT_FALSE(validate({ Instruction(I_CALL, 3, 1, 1, 2), Instruction(I_RET, 0, 0, 1, 0) }, 5));
+}
+
+TEST(vm_image_test, validate_global_test)
+{
+    EXPECT_TRUE(validate({ Instruction(I_GLOB, 0, 1, 1), Instruction(I_RET, 0, 0, 1, 0) }, 2, 2));
+    EXPECT_FALSE(validate({ Instruction(I_GLOB, 0, 1, 2), Instruction(I_RET, 0, 0, 1, 0) }, 2, 2));
+}
+
+TEST(vm_image_test, validate_constant_test)
+{
+    EXPECT_TRUE(validate({ Instruction(I_LC, 0, 1, 0), Instruction(I_RET, 0, 0, 1, 0) }, 2));
+    EXPECT_FALSE(validate({ Instruction(I_LC, 0, 1, 1), Instruction(I_RET, 0, 0, 1, 0) }, 2));
+}
+
+TEST(vm_image_test, validate_shift_test)
+{
+    EXPECT_TRUE(validate({ Instruction(I_ADD, 63, 1, 1, 1), Instruction(I_RET, 0, 0, 1, 0) }, 2));
+    EXPECT_FALSE(validate({ Instruction(I_ADD, 64, 1, 1, 1), Instruction(I_RET, 0, 0, 1, 0) }, 2));
+    EXPECT_FALSE(validate({ Instruction(I_SUB, 64, 1, 1, 1), Instruction(I_RET, 0, 0, 1, 0) }, 2));
+
+    EXPECT_TRUE(validate({ Instruction(I_SHLI, 0, 1, 1, 63), Instruction(I_RET, 0, 0, 1, 0) }, 2));
+    EXPECT_FALSE(validate({ Instruction(I_SHLI, 0, 1, 1, 64), Instruction(I_RET, 0, 0, 1, 0) }, 2));
+    EXPECT_FALSE(validate({
+        Instruction(I_SHRI, 0, 1, 1, static_cast<RegisterT>(-1)),
+        Instruction(I_RET, 0, 0, 1, 0)
+    }, 2));
+    EXPECT_FALSE(validate({ Instruction(I_SHRUI, 0, 1, 1, 64), Instruction(I_RET, 0, 0, 1, 0) }, 2));
+}
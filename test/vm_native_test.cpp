@@ -0,0 +1,87 @@
+#include <cstring>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "../lib/libcyan.hpp"
+#include "../lib/vm.hpp"
+
+using namespace cyan::vm;
+
+namespace {
+
+const char SOURCE[] =
+    "function sum7(a : i64, b : i64, c : i64, d : i64, e : i64, f : i64, g : i64) : i64;\n"
+    "function twice(a : i32) : i32;\n"
+    "function length(s : i8[]) : i64;\n"
+    "function note(value : i64);\n"
+    "function main() : i64 {\n"
+    "    note(1);\n"
+    "    let sum = sum7(1, 2, 3, 4, 5, 6, 7);\n"
+    "    note(sum);\n"
+    "    return sum * 1000 + twice(21) + length(\"hello\");\n"
+    "}\n"
+;
+
+const Slot EXPECTED = 28 * 1000 + 42 + 5;
+
+std::vector<int64_t> notes;
+
+int64_t
+sum7(int64_t a, int64_t b, int64_t c, int64_t d, int64_t e, int64_t f, int64_t g)
+{ return a + b + c + d + e + f + g; }
+
+int32_t
+twice(int32_t a)
+{ return a * 2; }
+
+int64_t
+length(const char *s)
+{ return std::strlen(s); }
+
+void
+note(int64_t value)
+{ notes.push_back(value); }
+
+std::unique_ptr<Program>
+generate()
+{
+    cyan::Parser parser(new cyan::ScreenOutputErrorCollector());
+    EXPECT_TRUE(parser.parse(SOURCE));
+
+    auto gen = Program::GenerateFactory(cyan::OptimizerLevel0(parser.release().release()).release());
+    gen->registerLibFunction("sum7", bindNative(sum7));
+    gen->registerLibFunction("twice", bindNative(twice));
+    gen->registerLibFunction("length", bindNative(length));
+    gen->registerLibFunction("note", bindNative(note));
+    gen->generate();
+    return gen->release();
+}
+
+}
+
+TEST(vm_native_test, direct_test)
+{
+    // more than six arguments, or an argument narrower than a slot, goes through the thunk
+    EXPECT_FALSE(std::unique_ptr<LibFunction>(bindNative(sum7))->direct);
+    EXPECT_FALSE(std::unique_ptr<LibFunction>(bindNative(twice))->direct);
+    EXPECT_TRUE(std::unique_ptr<LibFunction>(bindNative(length))->direct);
+    EXPECT_TRUE(std::unique_ptr<LibFunction>(bindNative(note))->direct);
+    EXPECT_TRUE(std::unique_ptr<LibFunction>(bindNative(note))->returns_void);
+}
+
+TEST(vm_native_test, interpreter_call_test)
+{
+    auto program = generate();
+    notes.clear();
+    EXPECT_EQ(EXPECTED, Context(program.get()).start());
+    EXPECT_EQ(std::vector<int64_t>({ 1, 28 }), notes);
+}
+
+TEST(vm_native_test, jit_call_test)
+{
+    auto program = generate();
+    notes.clear();
+    EXPECT_EQ(EXPECTED, Context(program.get()).startJIT());
+    EXPECT_EQ(std::vector<int64_t>({ 1, 28 }), notes);
+}
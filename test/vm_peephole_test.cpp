@@ -0,0 +1,175 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "../lib/vm.hpp"
+
+using namespace cyan::vm;
+
+namespace {
+
+std::vector<Instruction>
+optimize(const std::vector<Instruction> &code, size_t register_nr)
+{
+    VMFunction func("test", 0);
+    func.inst_list = code;
+    func.register_nr = register_nr;
+    Program::Generate::optimizeFunc(&func);
+    return func.inst_list;
+}
+
+void
+expectImmediate(const Instruction &inst, InstOperator op, RegisterT rd, ImmediateT imm)
+{
+    EXPECT_EQ(op, inst.i_op);
+    EXPECT_EQ(rd, inst.i_rd);
+    EXPECT_EQ(imm, inst.i_imm);
+}
+
+void
+expectRegisters(const Instruction &inst, InstOperator op, RegisterT rd, RegisterT rs, RegisterT rt)
+{
+    EXPECT_EQ(op, inst.i_op);
+    EXPECT_EQ(rd, inst.i_rd);
+    EXPECT_EQ(rs, inst.i_rs);
+    EXPECT_EQ(rt, inst.i_rt);
+}
+
+}
+
+TEST(vm_peephole_test, jump_threading_test)
+{
+    auto code = optimize({
+        Instruction(I_BR,   0, 1, 3),       // 0
+        Instruction(I_LI,   0, 2, 5),       // 1
+        Instruction(I_RET,  0, 0, 2, 0),    // 2
+        Instruction(I_JUMP, 0, 0, 4),       // 3
+        Instruction(I_ADD,  0, 2, 1, 1),    // 4
+        Instruction(I_RET,  0, 0, 2, 0),    // 5
+    }, 3);
+
+    // the BR goes straight to the ADD, the JUMP is left unreachable
+    ASSERT_EQ(5u, code.size());
+    expectImmediate(code[0], I_BR, 1, 3);
+    expectImmediate(code[1], I_LI, 2, 5);
+    expectRegisters(code[2], I_RET, 0, 2, 0);
+    expectRegisters(code[3], I_ADD, 2, 1, 1);
+    expectRegisters(code[4], I_RET, 0, 2, 0);
+}
+
+TEST(vm_peephole_test, jump_to_ret_test)
+{
+    auto code = optimize({
+        Instruction(I_BR,   0, 1, 3),       // 0
+        Instruction(I_LI,   0, 2, 5),       // 1
+        Instruction(I_JUMP, 0, 0, 4),       // 2
+        Instruction(I_LI,   0, 2, 6),       // 3
+        Instruction(I_RET,  0, 0, 2, 0),    // 4
+    }, 3);
+
+    ASSERT_EQ(5u, code.size());
+    expectImmediate(code[0], I_BR, 1, 3);
+    expectRegisters(code[2], I_RET, 0, 2, 0);
+    expectImmediate(code[3], I_LI, 2, 6);
+}
+
+TEST(vm_peephole_test, branch_inversion_test)
+{
+    auto code = optimize({
+        Instruction(I_BLT,  0, 2, 1, 2),    // 0, to 2 when r1 < r2
+        Instruction(I_JUMP, 0, 0, 4),       // 1
+        Instruction(I_LI,   0, 3, 1),       // 2
+        Instruction(I_RET,  0, 0, 3, 0),    // 3
+        Instruction(I_ADD,  0, 3, 1, 2),    // 4
+        Instruction(I_RET,  0, 0, 3, 0),    // 5
+    }, 4);
+
+    // !(r1 < r2) is r2 <= r1, branching to the old JUMP target
+    ASSERT_EQ(5u, code.size());
+    EXPECT_EQ(I_BLE, code[0].i_op);
+    EXPECT_EQ(2, code[0].i_rs);
+    EXPECT_EQ(1, code[0].i_rt);
+    EXPECT_EQ(3, code[0].i_target);
+    expectImmediate(code[1], I_LI, 3, 1);
+    expectRegisters(code[3], I_ADD, 3, 1, 2);
+}
+
+TEST(vm_peephole_test, load_immediate_call_test)
+{
+    auto code = optimize({
+        Instruction(I_GLOB, 0, 2, 0),           // 0
+        Instruction(I_LI,   0, 1, 5),           // 1, overwritten unread
+        Instruction(I_LI,   0, 1, 6),           // 2
+        Instruction(I_LI,   0, 1, 6),           // 3, already there
+        Instruction(I_LI,   0, 5, 9),           // 4, argument read by the CALL
+        Instruction(I_CALL, 1, 3, 2, 4),        // 5
+        Instruction(I_LI,   0, 1, 6),           // 6, the callee may have changed r1
+        Instruction(I_ADD,  0, 3, 3, 1),        // 7
+        Instruction(I_RET,  0, 0, 3, 0),        // 8
+    }, 6);
+
+    ASSERT_EQ(7u, code.size());
+    expectImmediate(code[0], I_GLOB, 2, 0);
+    expectImmediate(code[1], I_LI, 1, 6);
+    expectImmediate(code[2], I_LI, 5, 9);
+    EXPECT_EQ(I_CALL, code[3].i_op);
+    expectImmediate(code[4], I_LI, 1, 6);
+    expectRegisters(code[5], I_ADD, 3, 3, 1);
+}
+
+TEST(vm_peephole_test, load_immediate_label_test)
+{
+    auto code = optimize({
+        Instruction(I_LI,   0, 1, 6),           // 0
+        Instruction(I_BR,   0, 2, 3),           // 1
+        Instruction(I_ADD,  0, 2, 2, 1),        // 2
+        Instruction(I_LI,   0, 1, 6),           // 3, reached with r1 unknown
+        Instruction(I_ADD,  0, 2, 2, 1),        // 4
+        Instruction(I_RET,  0, 0, 2, 0),        // 5
+    }, 3);
+
+    ASSERT_EQ(6u, code.size());
+    expectImmediate(code[3], I_LI, 1, 6);
+}
+
+TEST(vm_peephole_test, copy_folding_test)
+{
+    auto code = optimize({
+        Instruction(I_ADD,  0, 3, 1, 2),
+        Instruction(I_MOV,  0, 4, 3, 0),
+        Instruction(I_RET,  0, 0, 4, 0),
+    }, 5);
+
+    ASSERT_EQ(2u, code.size());
+    expectRegisters(code[0], I_ADD, 4, 1, 2);
+    expectRegisters(code[1], I_RET, 0, 4, 0);
+}
+
+TEST(vm_peephole_test, copy_folding_live_test)
+{
+    auto code = optimize({
+        Instruction(I_ADD,  0, 3, 1, 2),
+        Instruction(I_MOV,  0, 4, 3, 0),
+        Instruction(I_SUB,  0, 5, 4, 3),    // the temporary is read again
+        Instruction(I_RET,  0, 0, 5, 0),
+    }, 6);
+
+    ASSERT_EQ(4u, code.size());
+    expectRegisters(code[0], I_ADD, 3, 1, 2);
+    expectRegisters(code[1], I_MOV, 4, 3, 0);
+}
+
+TEST(vm_peephole_test, copy_folding_branch_test)
+{
+    auto code = optimize({
+        Instruction(I_ADD,  0, 3, 1, 2),    // 0
+        Instruction(I_BR,   0, 1, 3),       // 1
+        Instruction(I_MOV,  0, 4, 3, 0),    // 2, its own block
+        Instruction(I_RET,  0, 0, 3, 0),    // 3
+    }, 5);
+
+    // the copy starts a block, nothing before it in the block to fold into
+    ASSERT_EQ(4u, code.size());
+    expectRegisters(code[0], I_ADD, 3, 1, 2);
+    expectRegisters(code[2], I_MOV, 4, 3, 0);
+}
@@ -0,0 +1,135 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "../lib/vm.hpp"
+
+using namespace cyan::vm;
+
+namespace {
+
+struct Allocated
+{
+    std::vector<Instruction> code;
+    size_t register_nr;
+    RegisterT outgoing_base;
+};
+
+// registers above the arguments and below outgoing_base are virtual, the window follows them
+Allocated
+allocate(const std::vector<Instruction> &code, size_t argument_nr, RegisterT outgoing_base, size_t outgoing_nr)
+{
+    VMFunction func("test", 0);
+    func.inst_list = code;
+    func.register_nr = outgoing_base + outgoing_nr + 1;
+    auto new_base = Program::Generate::allocateRegisters(&func, argument_nr, outgoing_base, outgoing_nr);
+    return Allocated{func.inst_list, func.register_nr, new_base};
+}
+
+void
+expectImmediate(const Instruction &inst, InstOperator op, RegisterT rd, ImmediateT imm)
+{
+    EXPECT_EQ(op, inst.i_op);
+    EXPECT_EQ(rd, inst.i_rd);
+    EXPECT_EQ(imm, inst.i_imm);
+}
+
+void
+expectRegisters(const Instruction &inst, InstOperator op, RegisterT rd, RegisterT rs, RegisterT rt)
+{
+    EXPECT_EQ(op, inst.i_op);
+    EXPECT_EQ(rd, inst.i_rd);
+    EXPECT_EQ(rs, inst.i_rs);
+    EXPECT_EQ(rt, inst.i_rt);
+}
+
+}
+
+TEST(vm_register_allocation_test, disjoint_intervals_test)
+{
+    auto result = allocate({
+        Instruction(I_LI,   0, 1, 5),       // 0
+        Instruction(I_LI,   0, 2, 6),       // 1
+        Instruction(I_ADD,  0, 3, 1, 2),    // 2
+        Instruction(I_LI,   0, 4, 7),       // 3
+        Instruction(I_ADD,  0, 5, 3, 4),    // 4
+        Instruction(I_RET,  0, 0, 5, 0),    // 5
+    }, 0, 6, 0);
+
+    // 1 and 2 are dead by the time 4 is written, five values fit in two registers
+    ASSERT_EQ(6u, result.code.size());
+    expectImmediate(result.code[0], I_LI, 1, 5);
+    expectImmediate(result.code[1], I_LI, 2, 6);
+    expectRegisters(result.code[2], I_ADD, 1, 1, 2);
+    expectImmediate(result.code[3], I_LI, 2, 7);
+    expectRegisters(result.code[4], I_ADD, 1, 1, 2);
+    expectRegisters(result.code[5], I_RET, 0, 1, 0);
+    EXPECT_EQ(3u, result.outgoing_base);
+    EXPECT_EQ(4u, result.register_nr);
+}
+
+TEST(vm_register_allocation_test, dying_operand_test)
+{
+    auto result = allocate({
+        Instruction(I_LI,   0, 1, 5),       // 0
+        Instruction(I_ADDI, 0, 2, 1, 1),    // 1
+        Instruction(I_ADD,  0, 3, 2, 1),    // 2
+        Instruction(I_RET,  0, 0, 3, 0),    // 3
+    }, 0, 4, 0);
+
+    // both operands are read at 2 * i, before the result is written at 2 * i + 1
+    ASSERT_EQ(4u, result.code.size());
+    expectImmediate(result.code[0], I_LI, 1, 5);
+    expectRegisters(result.code[1], I_ADDI, 2, 1, 1);
+    expectRegisters(result.code[2], I_ADD, 1, 2, 1);
+    expectRegisters(result.code[3], I_RET, 0, 1, 0);
+    EXPECT_EQ(3u, result.outgoing_base);
+}
+
+TEST(vm_register_allocation_test, phi_coalescing_test)
+{
+    auto result = allocate({
+        Instruction(I_LI,   0, 2, 10),      // 0
+        Instruction(I_BNR,  0, 1, 5),       // 1
+        Instruction(I_ADDI, 0, 3, 2, 1),    // 2
+        Instruction(I_MOV,  0, 4, 3, 0),    // 3
+        Instruction(I_JUMP, 0, 0, 6),       // 4
+        Instruction(I_MOV,  0, 4, 2, 0),    // 5
+        Instruction(I_RET,  0, 0, 4, 0),    // 6
+    }, 1, 5, 0);
+
+    // 4 takes the register of 3 dying at the first mov, which goes away with the targets behind it
+    ASSERT_EQ(6u, result.code.size());
+    expectImmediate(result.code[0], I_LI, 2, 10);
+    expectImmediate(result.code[1], I_BNR, 1, 4);
+    expectRegisters(result.code[2], I_ADDI, 3, 2, 1);
+    expectImmediate(result.code[3], I_JUMP, 0, 5);
+    expectRegisters(result.code[4], I_MOV, 3, 2, 0);
+    expectRegisters(result.code[5], I_RET, 0, 3, 0);
+}
+
+TEST(vm_register_allocation_test, fixed_registers_test)
+{
+    auto result = allocate({
+        Instruction(I_LI,   0, 3, 1),       // 0
+        Instruction(I_ADD,  0, 4, 1, 3),    // 1
+        Instruction(I_MOV,  0, 8, 2, 0),    // 2
+        Instruction(I_MOV,  0, 9, 4, 0),    // 3
+        Instruction(I_CALL, 2, 5, 1, 7),    // 4
+        Instruction(I_ADD,  0, 6, 5, 2),    // 5
+        Instruction(I_RET,  0, 0, 6, 0),    // 6
+    }, 2, 7, 2);
+
+    // the arguments keep 1 and 2, the window moves down right behind the one register left in use
+    ASSERT_EQ(7u, result.code.size());
+    expectImmediate(result.code[0], I_LI, 3, 1);
+    expectRegisters(result.code[1], I_ADD, 3, 1, 3);
+    expectRegisters(result.code[2], I_MOV, 5, 2, 0);
+    expectRegisters(result.code[3], I_MOV, 6, 3, 0);
+    expectRegisters(result.code[4], I_CALL, 3, 1, 4);
+    EXPECT_EQ(2u, result.code[4].i_shift);
+    expectRegisters(result.code[5], I_ADD, 3, 3, 2);
+    expectRegisters(result.code[6], I_RET, 0, 3, 0);
+    EXPECT_EQ(4u, result.outgoing_base);
+    EXPECT_EQ(7u, result.register_nr);
+}
@@ -0,0 +1,113 @@
+#include <iostream>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "../lib/libcyan.hpp"
+#include "../lib/vm.hpp"
+
+using namespace cyan::vm;
+
+namespace {
+
+// every call of f allocates its local on the VM stack at O0
+const char SOURCE[] =
+    "function f(n : i64) : i64 {\n"
+    "    let a = n;\n"
+    "    return f(a + 1);\n"
+    "}\n"
+    "function main() : i64 {\n"
+    "    return f(0);\n"
+    "}\n"
+;
+
+// g uses no VM stack, its frames pile up in registers and, compiled, on the host stack
+const char RECURSION_SOURCE[] =
+    "function g(n : i64) : i64 {\n"
+    "    return g(n + 1) + 1;\n"
+    "}\n"
+    "function main() : i64 {\n"
+    "    return g(0);\n"
+    "}\n"
+;
+
+std::unique_ptr<Program>
+generate(const char *source = SOURCE)
+{
+    cyan::Parser parser(new cyan::ScreenOutputErrorCollector());
+    EXPECT_TRUE(parser.parse(source));
+
+    auto gen = Program::GenerateFactory(cyan::OptimizerLevel0(parser.release().release()).release());
+    gen->generate();
+    return gen->release();
+}
+
+}
+
+TEST(vm_stack_test, overflow_test)
+{
+    auto program = generate();
+    Context context(program.get(), 4096);
+    try {
+        context.start();
+        FAIL();
+    }
+    catch (const Context::StackOverflowException &e) {
+        EXPECT_EQ(std::string("VM stack overflow in f, 4K reserved"), e.what());
+    }
+}
+
+TEST(vm_stack_test, jit_overflow_test)
+{
+    // compiled frames can't be unwound, the overflow goes to the fatal handler
+    EXPECT_EXIT({
+        auto program = generate();
+        Context context(program.get(), 4096);
+        context.setFatalHandler([] (const std::exception &e) {
+            std::cerr << "handled: " << e.what() << std::endl;
+            std::exit(3);
+        });
+        context.startJIT();
+    }, ::testing::ExitedWithCode(3), "handled: VM stack overflow in f, 4K reserved");
+}
+
+TEST(vm_stack_test, default_fatal_handler_test)
+{
+    auto program = generate();
+    EXPECT_DEATH(Context(program.get(), 4096).startJIT(), "ERR!: VM stack overflow in f, 4K reserved");
+}
+
+TEST(vm_stack_test, register_overflow_test)
+{
+    auto program = generate(RECURSION_SOURCE);
+    Context context(program.get());
+    try {
+        context.start();
+        FAIL();
+    }
+    catch (const Context::StackOverflowException &e) {
+        EXPECT_EQ(std::string("register stack overflow in g, 32768K reserved"), e.what());
+    }
+}
+
+TEST(vm_stack_test, native_overflow_test)
+{
+    // direct calls between compiled functions check the host stack
+    for (auto tiered : { false, true }) {
+        EXPECT_EXIT({
+            auto program = generate(RECURSION_SOURCE);
+            Context context(program.get());
+            context.setFatalHandler([] (const std::exception &e) {
+                std::cerr << "handled: " << e.what() << std::endl;
+                std::exit(3);
+            });
+            tiered ? context.startTiered(2, 3) : context.startJIT();
+        }, ::testing::ExitedWithCode(3), "handled: native stack overflow in g, [0-9]+K reserved");
+    }
+}
+
+TEST(vm_stack_test, map_failed_test)
+{
+    auto program = generate();
+    EXPECT_THROW(Context(program.get(), static_cast<size_t>(1) << 62), MapFailedException);
+}
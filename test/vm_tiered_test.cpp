@@ -0,0 +1,200 @@
+#include <iostream>
+
+#include "gtest/gtest.h"
+
+#include "../lib/libcyan.hpp"
+#include "../lib/vm.hpp"
+
+using namespace cyan::vm;
+
+namespace {
+
+// fib gets hot by calls, main and sum by back-edges, cold runs only once
+const char SOURCE[] =
+    "struct Box {\n"
+    "    value : i64\n"
+    "}\n"
+    "function fib(n : i64) : i64 {\n"
+    "    if (n < 2) {\n"
+    "        return n;\n"
+    "    }\n"
+    "    return fib(n - 1) + fib(n - 2);\n"
+    "}\n"
+    "function sum(n : i64) : i64 {\n"
+    "    let box = new Box;\n"
+    "    box.value = 0;\n"
+    "    let i = 0;\n"
+    "    while (i < n) {\n"
+    "        box.value = box.value + i;\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "    let ret = box.value;\n"
+    "    delete box;\n"
+    "    return ret;\n"
+    "}\n"
+    "function cold() : i64 {\n"
+    "    return 7;\n"
+    "}\n"
+    "function main() : i64 {\n"
+    "    let total = cold();\n"
+    "    let i = 0;\n"
+    "    while (i < 50) {\n"
+    "        total = total + fib(i % 12) + sum(i);\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "    return total;\n"
+    "}\n"
+;
+
+// nested loops over locals on the VM stack, entered mid-way when main gets hot
+const char LOOP_SOURCE[] =
+    "function main() : i64 {\n"
+    "    let total = 0;\n"
+    "    let i = 0;\n"
+    "    while (i < 30) {\n"
+    "        let j = 0;\n"
+    "        while (j < i) {\n"
+    "            total = total + i * j;\n"
+    "            j = j + 1;\n"
+    "        }\n"
+    "        total = total - i;\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "    return total;\n"
+    "}\n"
+;
+
+// more loop registers than host registers, live across a call and across OSR entry
+const char PRESSURE_SOURCE[] =
+    "function mix(a : i64, b : i64) : i64 {\n"
+    "    return a * 3 + b;\n"
+    "}\n"
+    "function main() : i64 {\n"
+    "    let a = 1;\n"
+    "    let b = 2;\n"
+    "    let c = 3;\n"
+    "    let d = 4;\n"
+    "    let e = 5;\n"
+    "    let f = 6;\n"
+    "    let g = 7;\n"
+    "    let h = 8;\n"
+    "    let i = 0;\n"
+    "    while (i < 40) {\n"
+    "        a = a + b;\n"
+    "        b = (b ^ c) | 1;\n"
+    "        c = c - d;\n"
+    "        d = mix(d, e) % 1000;\n"
+    "        e = e * 2 % 997;\n"
+    "        f = f + g - h;\n"
+    "        g = g & 255;\n"
+    "        h = h + i;\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "    return a + b + c + d + e + f + g + h;\n"
+    "}\n"
+;
+
+// f overflows the VM stack, which throws unless a compiled frame is below it
+const char OVERFLOW_SOURCE[] =
+    "function f(n : i64) : i64 {\n"
+    "    let a = n;\n"
+    "    return f(a + 1);\n"
+    "}\n"
+    "function main() : i64 {\n"
+    "    let i = 0;\n"
+    "    while (i < 100) {\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "    return f(i);\n"
+    "}\n"
+;
+
+std::unique_ptr<Program>
+generate(const char *source = SOURCE)
+{
+    cyan::Parser parser(new cyan::ScreenOutputErrorCollector());
+    EXPECT_TRUE(parser.parse(source));
+
+    auto gen = Program::GenerateFactory(cyan::OptimizerLevel0(parser.release().release()).release());
+    gen->generate();
+    return gen->release();
+}
+
+}
+
+TEST(vm_tiered_test, threshold_test)
+{
+    auto program = generate();
+    auto expected = Context(program.get()).start();
+
+    // from everything compiled at once to nothing compiled at all
+    for (auto thresholds : { std::make_pair(1u, 1u), std::make_pair(2u, 3u), std::make_pair(5u, 50u),
+                             std::make_pair(1000u, 1u), std::make_pair(1u, 100000u),
+                             std::make_pair(100000u, 100000u) }) {
+        EXPECT_EQ(expected, Context(program.get()).startTiered(thresholds.first, thresholds.second));
+    }
+}
+
+TEST(vm_tiered_test, shared_code_test)
+{
+    auto program = generate();
+    auto expected = Context(program.get()).start();
+
+    // code compiled by one context is picked up by the next, and by a JIT context
+    EXPECT_EQ(expected, Context(program.get()).startTiered(3, 5));
+    EXPECT_EQ(expected, Context(program.get()).startTiered(100000, 100000));
+    EXPECT_EQ(expected, Context(program.get()).startJIT());
+    EXPECT_EQ(expected, Context(program.get()).startTiered(3, 5));
+}
+
+TEST(vm_tiered_test, handle_test)
+{
+    auto program = generate();
+    auto fib = program->prepare<long(long)>("fib");
+    auto sum = program->prepare<long(long)>("sum");
+
+    Context context(program.get());
+    context.setupTiered(10, 10);
+    for (long i = 0; i < 20; ++i) {
+        EXPECT_EQ(i * (i - 1) / 2, sum(context, i));
+    }
+    EXPECT_EQ(610, fib(context, 15));
+}
+
+TEST(vm_tiered_test, osr_test)
+{
+    auto program = generate(LOOP_SOURCE);
+    auto expected = Context(program.get()).start();
+
+    // main is called once, only its back-edges make it hot
+    for (uint32_t back_edge_threshold = 1; back_edge_threshold < 40; ++back_edge_threshold) {
+        EXPECT_EQ(expected, Context(program.get()).startTiered(100000, back_edge_threshold));
+    }
+}
+
+TEST(vm_tiered_test, host_register_test)
+{
+    auto program = generate(PRESSURE_SOURCE);
+    auto expected = Context(program.get()).start();
+
+    EXPECT_EQ(expected, Context(program.get()).startJIT());
+    for (uint32_t back_edge_threshold = 1; back_edge_threshold < 45; ++back_edge_threshold) {
+        EXPECT_EQ(expected, Context(program.get()).startTiered(100000, back_edge_threshold));
+    }
+}
+
+TEST(vm_tiered_test, osr_overflow_test)
+{
+    auto program = generate(OVERFLOW_SOURCE);
+    EXPECT_THROW(Context(program.get(), 4096).startTiered(100000, 100000), Context::StackOverflowException);
+
+    // main finishes compiled after its loop moved to the JIT, f then overflows under a compiled frame
+    EXPECT_EXIT({
+        Context context(program.get(), 4096);
+        context.setFatalHandler([] (const std::exception &e) {
+            std::cerr << "handled: " << e.what() << std::endl;
+            std::exit(3);
+        });
+        context.startTiered(100000, 10);
+    }, ::testing::ExitedWithCode(3), "handled: VM stack overflow in f, 4K reserved");
+}